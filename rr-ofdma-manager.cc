@@ -19,22 +19,282 @@
  */
 
 #include "ns3/log.h"
+#include "ns3/pointer.h"
+#include "ns3/simulator.h"
 #include "rr-ofdma-manager.h"
 #include "wifi-ack-policy-selector.h"
 #include "wifi-phy.h"
 #include <utility>
 #include <algorithm>
-#include <fstream>
-#include <iostream>
+#include <chrono>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <limits>
+#include <tuple>
 
 
 namespace ns3 {
 
 NS_LOG_COMPONENT_DEFINE ("RrOfdmaManager");
 
+namespace {
+
+/// Metrics of a candidate station used by the scheduling policies
+struct CandidateMetrics
+{
+  double qosWeight;     //!< weight of the access category (a_i)
+  double holDelay;      //!< head-of-line delay in seconds
+  double instRate;      //!< instantaneous rate in bit/s
+  double avgRate;       //!< average rate in bit/s
+};
+
+/**
+ * Interface of the policies used by RrOfdmaManager to select the stations
+ * to serve and size their RUs.
+ */
+class DlSchedulingPolicy
+{
+public:
+  virtual ~DlSchedulingPolicy () {}
+  /**
+   * \return true if stations are served in round robin order and assigned RUs
+   *         of equal size, in which case weights are not used
+   */
+  virtual bool IsEqualSplit (void) const
+  {
+    return false;
+  }
+  /**
+   * \param m the metrics of a candidate station
+   * \return the weight of the candidate station
+   */
+  virtual double GetWeight (const CandidateMetrics& m) const = 0;
+};
+
+/// Round robin with RUs of equal size
+class RoundRobinPolicy : public DlSchedulingPolicy
+{
+public:
+  bool IsEqualSplit (void) const
+  {
+    return true;
+  }
+  double GetWeight (const CandidateMetrics& /* m */) const
+  {
+    return 1;
+  }
+};
+
+/// Modified Largest Weighted Delay First: a_i * W_i * r_i / avg_r_i
+class LwdfPolicy : public DlSchedulingPolicy
+{
+public:
+  double GetWeight (const CandidateMetrics& m) const
+  {
+    // the average rate is at least 1 bit/s to keep the ratio finite
+    return m.qosWeight * m.holDelay * m.instRate / std::max (m.avgRate, 1.0);
+  }
+};
+
+/// Proportional fair: r_i / avg_r_i
+class ProportionalFairPolicy : public DlSchedulingPolicy
+{
+public:
+  double GetWeight (const CandidateMetrics& m) const
+  {
+    return m.instRate / std::max (m.avgRate, 1.0);
+  }
+};
+
+/// Maximum rate: r_i
+class MaxRatePolicy : public DlSchedulingPolicy
+{
+public:
+  double GetWeight (const CandidateMetrics& m) const
+  {
+    return m.instRate;
+  }
+};
+
+/**
+ * \param policy the scheduling policy
+ * \return the object implementing the given scheduling policy
+ */
+const DlSchedulingPolicy&
+GetDlSchedulingPolicy (RrOfdmaManager::SchedulingPolicy policy)
+{
+  static const RoundRobinPolicy rr;
+  static const LwdfPolicy lwdf;
+  static const ProportionalFairPolicy pf;
+  static const MaxRatePolicy maxRate;
+
+  switch (policy)
+    {
+    case RrOfdmaManager::ROUND_ROBIN:
+      return rr;
+    case RrOfdmaManager::LWDF:
+      return lwdf;
+    case RrOfdmaManager::PROPORTIONAL_FAIR:
+      return pf;
+    case RrOfdmaManager::MAX_RATE:
+      return maxRate;
+    default:
+      NS_FATAL_ERROR ("Unknown scheduling policy: " << policy);
+    }
+  return lwdf;
+}
+
+/// Granularity (bytes) of the PSDU sizes used as keys of the airtime cache
+static const uint32_t AIRTIME_BYTE_BUCKET = 256;
+
+/// Maximum number of entries of the airtime cache
+static const std::size_t AIRTIME_CACHE_MAX_ENTRIES = 4096;
+
+/// Bytes corresponding to a unit of the queue size reported in a buffer status
+static const uint32_t BUFFER_STATUS_UNIT = 256;
+
+/// Size in bytes of the QoS Null frame sent in response to a BSRP Trigger Frame
+static const uint32_t QOS_NULL_SIZE = 30;
+
+/**
+ * Record the wall-clock time spent in a scope (from construction to destruction)
+ * in the given histogram.
+ */
+class ScopedTimer
+{
+public:
+  /**
+   * \param metrics the metrics object
+   * \param id the histogram in which the elapsed time is recorded
+   */
+  ScopedTimer (Ptr<RrOfdmaMetrics> metrics, RrOfdmaMetrics::HistogramId id)
+    : m_metrics (metrics),
+      m_id (id),
+      m_start (std::chrono::steady_clock::now ())
+  {
+  }
+  ~ScopedTimer ()
+  {
+    auto elapsed = std::chrono::steady_clock::now () - m_start;
+    m_metrics->Record (m_id, std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ());
+  }
+
+private:
+  Ptr<RrOfdmaMetrics> m_metrics;                        //!< the metrics object
+  RrOfdmaMetrics::HistogramId m_id;                     //!< the histogram
+  std::chrono::steady_clock::time_point m_start;        //!< start time
+};
+
+} // unnamed namespace
+
+NS_OBJECT_ENSURE_REGISTERED (RrOfdmaMetrics);
+
+TypeId
+RrOfdmaMetrics::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::RrOfdmaMetrics")
+    .SetParent<Object> ()
+    .SetGroupName ("Wifi")
+    .AddConstructor<RrOfdmaMetrics> ()
+  ;
+  return tid;
+}
+
+RrOfdmaMetrics::RrOfdmaMetrics ()
+{
+  Reset ();
+}
+
+RrOfdmaMetrics::~RrOfdmaMetrics ()
+{
+}
+
+void
+RrOfdmaMetrics::Increment (Counter counter)
+{
+  NS_ASSERT (counter < N_COUNTERS);
+  m_counters[counter]++;
+}
+
+void
+RrOfdmaMetrics::Record (HistogramId id, uint64_t value)
+{
+  NS_ASSERT (id < N_HISTOGRAMS);
+  uint64_t bin = value;
+  if (id == SELECT_TX_FORMAT_TIME || id == COMPUTE_DL_OFDMA_INFO_TIME)
+    {
+      // the lower bound of the bin is the largest power of two not exceeding value
+      for (bin = (value > 0 ? 1 : 0); bin > 0 && bin <= value / 2; bin <<= 1)
+        {
+        }
+    }
+  m_histograms[id][bin]++;
+}
+
+uint64_t
+RrOfdmaMetrics::GetCounter (Counter counter) const
+{
+  NS_ASSERT (counter < N_COUNTERS);
+  return m_counters[counter];
+}
+
+const RrOfdmaMetrics::Histogram&
+RrOfdmaMetrics::GetHistogram (HistogramId id) const
+{
+  NS_ASSERT (id < N_HISTOGRAMS);
+  return m_histograms[id];
+}
+
+const char*
+RrOfdmaMetrics::GetCounterName (Counter counter)
+{
+  static const char* names[N_COUNTERS] = {"DlOfdmaReturns", "UlOfdmaReturns", "NonOfdmaReturns",
+                                          "TxopShortageFallbacks", "ShortMaxDurationFallbacks",
+                                          "CustomAllocations", "EqualSplitAllocations",
+                                          "AirtimeCacheHits", "AirtimeCacheMisses", "BsrpTriggers"};
+  NS_ASSERT (counter < N_COUNTERS);
+  return names[counter];
+}
+
+const char*
+RrOfdmaMetrics::GetHistogramName (HistogramId id)
+{
+  static const char* names[N_HISTOGRAMS] = {"UsersPerPpdu", "RuSize", "SelectTxFormatTimeNs",
+                                            "ComputeDlOfdmaInfoTimeNs", "UlPaddingPercent",
+                                            "DlPpdusPerTxop"};
+  NS_ASSERT (id < N_HISTOGRAMS);
+  return names[id];
+}
+
+void
+RrOfdmaMetrics::Reset (void)
+{
+  m_counters.fill (0);
+  for (auto& histogram : m_histograms)
+    {
+      histogram.clear ();
+    }
+}
+
+void
+RrOfdmaMetrics::Print (std::ostream& os) const
+{
+  for (uint8_t i = 0; i < N_COUNTERS; i++)
+    {
+      os << GetCounterName (static_cast<Counter> (i)) << " " << m_counters[i] << std::endl;
+    }
+  for (uint8_t i = 0; i < N_HISTOGRAMS; i++)
+    {
+      os << GetHistogramName (static_cast<HistogramId> (i));
+      for (auto& bin : m_histograms[i])
+        {
+          os << " " << bin.first << ":" << bin.second;
+        }
+      os << std::endl;
+    }
+}
+
 NS_OBJECT_ENSURE_REGISTERED (RrOfdmaManager);
 
 TypeId
@@ -64,17 +324,110 @@ RrOfdmaManager::GetTypeId (void)
                    UintegerValue (500),
                    MakeUintegerAccessor (&RrOfdmaManager::m_ulPsduSize),
                    MakeUintegerChecker<uint32_t> ())
-    .AddAttribute ("ChannelBw",
-                   "For TESTING only",
-                   UintegerValue (20),
-                   MakeUintegerAccessor (&RrOfdmaManager::m_bw),
-                   MakeUintegerChecker<uint16_t> (5, 160))
+    .AddAttribute ("EnableBsrp",
+                   "If enabled, when an UL OFDMA transmission is possible, send a BSRP Trigger "
+                   "Frame to the stations whose buffer status is stale, if any, before "
+                   "soliciting data frames. A BSRP Trigger Frame is never followed by another "
+                   "one if data frames can be solicited, so that UL data is not starved.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&RrOfdmaManager::m_enableBsrp),
+                   MakeBooleanChecker ())
+    .AddAttribute ("BufferStatusTimeout",
+                   "The time after which the buffer status reported by (or solicited from) "
+                   "a station is considered stale.",
+                   TimeValue (MilliSeconds (50)),
+                   MakeTimeAccessor (&RrOfdmaManager::m_bufferStatusTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("BsrpGroupSize",
+                   "The maximum number of stations solicited by a BSRP Trigger Frame.",
+                   UintegerValue (9),
+                   MakeUintegerAccessor (&RrOfdmaManager::m_bsrpGroupSize),
+                   MakeUintegerChecker<uint8_t> (1, 74))
+    .AddAttribute ("LinkQualityTimeout",
+                   "The time after which the SNR measured on the frames received from a station "
+                   "is considered stale. The MCS used for stations with a stale SNR is the one "
+                   "selected by the remote station manager for SU transmissions.",
+                   TimeValue (MilliSeconds (100)),
+                   MakeTimeAccessor (&RrOfdmaManager::m_linkQualityTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("SuTxVectorTimeout",
+                   "The time after which the TX vector used for SU transmissions to a station, "
+                   "which is cached to avoid querying the remote station manager for every "
+                   "candidate station, is requested again to the remote station manager.",
+                   TimeValue (MilliSeconds (20)),
+                   MakeTimeAccessor (&RrOfdmaManager::m_suTxVectorTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("SchedulingPolicy",
+                   "The policy used to select the stations and size their RUs. RR assigns "
+                   "RUs of equal size to stations served in round robin order, while the other "
+                   "policies select the stations with the largest weight and size their RUs "
+                   "in proportion to the weight. The weight is the M-LWDF metric (LWDF), the "
+                   "ratio between instantaneous and average rate (PF) or the instantaneous "
+                   "rate (MAX_RATE).",
+                   EnumValue (RrOfdmaManager::LWDF),
+                   MakeEnumAccessor (&RrOfdmaManager::m_schedulingPolicy),
+                   MakeEnumChecker (RrOfdmaManager::ROUND_ROBIN, "RR",
+                                    RrOfdmaManager::LWDF, "LWDF",
+                                    RrOfdmaManager::PROPORTIONAL_FAIR, "PF",
+                                    RrOfdmaManager::MAX_RATE, "MAX_RATE"))
+    .AddAttribute ("AverageRateTimeConstant",
+                   "The time constant of the exponentially weighted average of the rate "
+                   "at which each station is served.",
+                   TimeValue (MilliSeconds (100)),
+                   MakeTimeAccessor (&RrOfdmaManager::m_avgRateTau),
+                   MakeTimeChecker (MicroSeconds (1)))
+    .AddAttribute ("AdaptiveNStations",
+                   "If enabled, the number of stations (up to NStations) that are served by a "
+                   "DL MU PPDU is the one maximizing the goodput estimated (with RUs of equal "
+                   "size) from the per-user MCS and backlog, the PPDU preamble and padding and "
+                   "the acknowledgment sequence. With weighted scheduling policies, the stations "
+                   "with the highest weight are served and their RUs are then sized by weight.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&RrOfdmaManager::m_adaptiveNStations),
+                   MakeBooleanChecker ())
+    .AddAttribute ("SelectAckSequence",
+                   "If enabled, the acknowledgment sequence of every DL MU PPDU (SU format, "
+                   "MU-BAR or aggregated MU-BAR) is the one with the lowest cost (the time by "
+                   "which aggregated Trigger Frames extend the DL MU PPDU plus the response, "
+                   "including MU-BAR or BAR frames) among those fitting the remaining TXOP, "
+                   "rather than the one returned by the ack policy selector of the AC.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&RrOfdmaManager::m_selectAckSequence),
+                   MakeBooleanChecker ())
+    .AddAttribute ("TxopUserRotation",
+                   "If enabled, the DL MU PPDUs sent in the same TXOP serve different stations, "
+                   "with any scheduling policy: a station served by a DL MU PPDU is only served "
+                   "again in the same TXOP if not enough other stations have frames that fit "
+                   "the remaining TXOP. Every DL MU PPDU may use the whole remaining TXOP.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&RrOfdmaManager::m_txopUserRotation),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Metrics",
+                   "The aggregate metrics (decision counters and histograms of users per PPDU, "
+                   "RU sizes and time spent in the scheduler) collected by this OFDMA manager.",
+                   TypeId::ATTR_GET,
+                   PointerValue (),
+                   MakePointerAccessor (&RrOfdmaManager::GetMetrics),
+                   MakePointerChecker<RrOfdmaMetrics> ())
+    .AddTraceSource ("SchedulerDecision",
+                     "A scheduling decision (transmission format, users, RUs, MCSs and weights) "
+                     "has been made.",
+                     MakeTraceSourceAccessor (&RrOfdmaManager::m_decisionTrace),
+                     "ns3::RrOfdmaManager::SchedulerDecisionTracedCallback")
   ;
   return tid;
 }
 
 RrOfdmaManager::RrOfdmaManager ()
-  : m_startStation (0)
+  : m_startStation (0),
+    m_ulStartStation (0),
+    m_ulTriggerType (TriggerFrameType::BASIC_TRIGGER),
+    m_lastUlBsrp (false),
+    m_txopEnd (Time::Min ()),
+    m_nSentPpdus (0),
+    m_tracesConnected (false),
+    m_phyFrequency (0),
+    m_metrics (CreateObject<RrOfdmaMetrics> ())
 {
   NS_LOG_FUNCTION (this);
 }
@@ -84,6 +437,113 @@ RrOfdmaManager::~RrOfdmaManager ()
   NS_LOG_FUNCTION_NOARGS ();
 }
 
+void
+RrOfdmaManager::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+  NS_LOG_INFO ("Airtime cache: " << m_metrics->GetCounter (RrOfdmaMetrics::AIRTIME_CACHE_HITS) << " hits, "
+               << m_metrics->GetCounter (RrOfdmaMetrics::AIRTIME_CACHE_MISSES) << " misses");
+  if (m_tracesConnected)
+    {
+      DisconnectTraces ();
+    }
+  m_airtimeCache.clear ();
+  m_metrics = 0;
+  OfdmaManager::DoDispose ();
+}
+
+void
+RrOfdmaManager::ConnectTraces (void)
+{
+  NS_LOG_FUNCTION (this);
+  // start tracking the quality of the links with the stations
+  NS_ABORT_MSG_UNLESS (m_low->GetPhy ()->TraceConnectWithoutContext ("MonitorSnifferRx",
+                                                                     MakeCallback (&RrOfdmaManager::NotifyMonitorSnifferRx, this)),
+                       "Failed to connect to the MonitorSnifferRx trace source of the PHY");
+  // and the rate at which they are served
+  NS_ABORT_MSG_UNLESS (m_low->TraceConnectWithoutContext ("ForwardDown",
+                                                          MakeCallback (&RrOfdmaManager::NotifyPsduForwardedDown, this)),
+                       "Failed to connect to the ForwardDown trace source of MacLow");
+  // the transmission failures that may cause a rate change
+  NS_ABORT_MSG_UNLESS (GetWifiRemoteStationManager ()->TraceConnectWithoutContext ("MacTxDataFailed",
+                                                                                   MakeCallback (&RrOfdmaManager::NotifyTxFailed, this)),
+                       "Failed to connect to the MacTxDataFailed trace source of the station manager");
+  NS_ABORT_MSG_UNLESS (GetWifiRemoteStationManager ()->TraceConnectWithoutContext ("MacTxFinalDataFailed",
+                                                                                   MakeCallback (&RrOfdmaManager::NotifyTxFailed, this)),
+                       "Failed to connect to the MacTxFinalDataFailed trace source of the station manager");
+  // and the frames queued for them (including those to retransmit)
+  for (auto& txop : m_qosTxop)
+    {
+      for (auto queue : {txop.second->GetWifiMacQueue (), txop.second->GetBaManager ()->GetRetransmitQueue ()})
+        {
+          NS_ABORT_MSG_UNLESS (queue->TraceConnectWithoutContext ("Enqueue", MakeCallback (&RrOfdmaManager::NotifyEnqueue, this)),
+                               "Failed to connect to the Enqueue trace source of a MAC queue");
+          NS_ABORT_MSG_UNLESS (queue->TraceConnectWithoutContext ("Dequeue", MakeCallback (&RrOfdmaManager::NotifyDequeue, this)),
+                               "Failed to connect to the Dequeue trace source of a MAC queue");
+        }
+    }
+  m_tracesConnected = true;
+}
+
+void
+RrOfdmaManager::DisconnectTraces (void)
+{
+  NS_LOG_FUNCTION (this);
+  // the objects owning the trace sources may have been disposed already
+  Ptr<WifiPhy> phy = m_low->GetPhy ();
+  if (phy != 0)
+    {
+      phy->TraceDisconnectWithoutContext ("MonitorSnifferRx",
+                                          MakeCallback (&RrOfdmaManager::NotifyMonitorSnifferRx, this));
+    }
+  m_low->TraceDisconnectWithoutContext ("ForwardDown",
+                                        MakeCallback (&RrOfdmaManager::NotifyPsduForwardedDown, this));
+  Ptr<WifiRemoteStationManager> stationManager = GetWifiRemoteStationManager ();
+  if (stationManager != 0)
+    {
+      stationManager->TraceDisconnectWithoutContext ("MacTxDataFailed",
+                                                     MakeCallback (&RrOfdmaManager::NotifyTxFailed, this));
+      stationManager->TraceDisconnectWithoutContext ("MacTxFinalDataFailed",
+                                                     MakeCallback (&RrOfdmaManager::NotifyTxFailed, this));
+    }
+  for (auto& txop : m_qosTxop)
+    {
+      std::vector<Ptr<WifiMacQueue>> queues {txop.second->GetWifiMacQueue ()};
+      if (txop.second->GetBaManager () != 0)
+        {
+          queues.push_back (txop.second->GetBaManager ()->GetRetransmitQueue ());
+        }
+      for (auto queue : queues)
+        {
+          if (queue != 0)
+            {
+              queue->TraceDisconnectWithoutContext ("Enqueue", MakeCallback (&RrOfdmaManager::NotifyEnqueue, this));
+              queue->TraceDisconnectWithoutContext ("Dequeue", MakeCallback (&RrOfdmaManager::NotifyDequeue, this));
+            }
+        }
+    }
+  m_tracesConnected = false;
+}
+
+Ptr<RrOfdmaMetrics>
+RrOfdmaManager::GetMetrics (void) const
+{
+  return m_metrics;
+}
+
+uint64_t
+RrOfdmaManager::GetAirtimeCacheHits (void) const
+{
+  // the metrics are released when the object is disposed
+  return (m_metrics != 0 ? m_metrics->GetCounter (RrOfdmaMetrics::AIRTIME_CACHE_HITS) : 0);
+}
+
+uint64_t
+RrOfdmaManager::GetAirtimeCacheMisses (void) const
+{
+  return (m_metrics != 0 ? m_metrics->GetCounter (RrOfdmaMetrics::AIRTIME_CACHE_MISSES) : 0);
+}
+
 
  /**
    * Compute the TX vector and the TX params for a DL MU transmission assuming
@@ -99,54 +559,41 @@ void
 RrOfdmaManager::InitTxVectorAndParams (std::map<Mac48Address, DlPerStaInfo> staList,
                                          HeRu::RuType ruType, DlMuAckSequenceType dlMuAckSequence)
 {
-  std::cout<<"\n start: InitTxVectorAndParams";
   NS_LOG_FUNCTION (this);
 //NS_LOG_FUNCTION("ru:::::::::"<<ruType);
-  m_txVector = WifiTxVector ();
-  m_txVector.SetPreambleType (WIFI_PREAMBLE_HE_MU);
-  m_txVector.SetChannelWidth (m_low->GetPhy ()->GetChannelWidth ());
-  m_txVector.SetGuardInterval (m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ());
-  m_txVector.SetTxPowerLevel (GetWifiRemoteStationManager ()->GetDefaultTxPowerLevel ());
+  m_txVector = GetMuTxVectorTemplate ();
   m_txParams = MacLowTransmissionParameters ();
   m_txParams.SetDlMuAckSequenceType (dlMuAckSequence);
 
 
   Ptr<WifiMacQueueItem> mpdu = Copy (m_mpdu);
 
-std::cout<<"\n inside InitTxVectorAndParams: before for loop\n";
 
 /////////////////////////////////////////Reshan
-unsigned int i=0; 
   for (auto& sta : staList)
     {
       mpdu->GetHeader ().SetAddr1 (sta.first);
       // Get the TX vector used to transmit single user frames to the receiver
       // station (the RU index will be assigned by ComputeDlOfdmaInfo)
-      WifiTxVector suTxVector = m_low->GetDataTxVector (mpdu);
+      WifiTxVector suTxVector = GetSuTxVector (sta.second.aid, mpdu);
       NS_LOG_DEBUG ("Adding STA with AID=" << sta.second.aid << " and TX mode="
                     << suTxVector.GetMode () << " to the TX vector");
 
 
 ///////ReshanFaraz///////////////////
-std::cout<<"\n inside InitTxVectorAndParams: before your code\n";
 
-if(finalRUAlloc.size()!=0){
-  std::cout<<"mappedRuAllocated-----"<<mappedRuAllocated[i];
-  m_txVector.SetHeMuUserInfo (sta.second.aid, {{false,mappedRuAllocated[i], 1}, suTxVector.GetMode (), suTxVector.GetNss ()});
-  i++;
+auto ruTypeIt = mappedRuAllocated.find (sta.second.aid);
+if(ruTypeIt != mappedRuAllocated.end ()){
+  m_txVector.SetHeMuUserInfo (sta.second.aid, {{false, ruTypeIt->second, 1}, suTxVector.GetMode (), suTxVector.GetNss ()});
 }
 else      
   m_txVector.SetHeMuUserInfo (sta.second.aid, {{false, ruType, 1}, suTxVector.GetMode (), suTxVector.GetNss ()});
 //////////////////////////////
 
       // Add the receiver station to the appropriate list of the TX params
-      Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (sta.second.tid)];
-      BlockAckReqType barType = txop->GetBaAgreementEstablished (sta.first, sta.second.tid)
-                                ? txop->GetBlockAckReqType (sta.first, sta.second.tid)
-                                : BlockAckReqType::COMPRESSED;
-      BlockAckType baType = txop->GetBaAgreementEstablished (sta.first, sta.second.tid)
-                            ? txop->GetBlockAckType (sta.first, sta.second.tid)
-                            : BlockAckType::COMPRESSED;
+      BlockAckReqType barType;
+      BlockAckType baType;
+      GetBlockAckTypes (sta.first, sta.second.tid, barType, baType);
 
       if (dlMuAckSequence == DlMuAckSequenceType::DL_SU_FORMAT)
         {
@@ -180,6 +627,26 @@ else
 
 OfdmaTxFormat
 RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
+{
+  ScopedTimer timer (m_metrics, RrOfdmaMetrics::SELECT_TX_FORMAT_TIME);
+  OfdmaTxFormat format = DoSelectTxFormat (mpdu);
+
+  switch (format)
+    {
+    case DL_OFDMA:
+      m_metrics->Increment (RrOfdmaMetrics::DL_OFDMA_RETURNS);
+      break;
+    case UL_OFDMA:
+      m_metrics->Increment (RrOfdmaMetrics::UL_OFDMA_RETURNS);
+      break;
+    default:
+      m_metrics->Increment (RrOfdmaMetrics::NON_OFDMA_RETURNS);
+    }
+  return format;
+}
+
+OfdmaTxFormat
+RrOfdmaManager::DoSelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
 {
   // --- for TESTING only ---
 //   for (uint8_t i = 1; i <= m_nStations; i++)
@@ -199,15 +666,45 @@ RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
       // check if an UL OFDMA transmission is possible after a DL OFDMA transmission
       NS_ABORT_MSG_IF (m_ulPsduSize == 0, "The UlPsduSize attribute must be set to a non-null value");
 
+      // select the users of the HE TB PPDU and their RUs based on the buffer status
+      // they reported, independently of the users of the last DL MU PPDU. If no
+      // station has frames to send, m_txVector has no users and UL OFDMA is skipped.
+      // Stations whose buffer status is stale are solicited first, if enabled, unless
+      // the last Trigger Frame was a BSRP: BSRP and Basic Trigger Frames alternate,
+      // so that UL data is not starved when more stations are stale than a BSRP
+      // Trigger Frame can solicit
+      const std::map<uint16_t, Mac48Address>& staList = m_apMac->GetStaList ();
+      UpdateStationTable (staList);
+      uint16_t nextUlStation = m_ulStartStation;
+      std::size_t nUlUsers = 0;
+      if (m_enableBsrp && !m_lastUlBsrp)
+        {
+          nUlUsers = ScheduleBsrpUsers (staList);
+        }
+      if (nUlUsers == 0)
+        {
+          nUlUsers = ScheduleUlUsers (staList, nextUlStation);
+        }
+      if (nUlUsers == 0 && m_enableBsrp && m_lastUlBsrp)
+        {
+          ScheduleBsrpUsers (staList);
+        }
+
       Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (mpdu->GetHeader ().GetQosTid ())];
       m_ulMuAckSequence = txop->GetAckPolicySelector ()->GetAckSequenceForUlMu ();
       MacLowTransmissionParameters params;
-      params.SetUlMuAckSequenceType (m_ulMuAckSequence);
-      BlockAckType baType;
 
-      if (m_ulMuAckSequence == UL_MULTI_STA_BLOCK_ACK)
+      // QoS Null frames sent in response to a BSRP Trigger Frame are not acknowledged,
+      // hence no UL MU ack sequence is set in that case
+      if (m_ulTriggerType != TriggerFrameType::BSRP_TRIGGER)
         {
-          baType = BlockAckType::MULTI_STA;
+          if (m_ulMuAckSequence != UL_MULTI_STA_BLOCK_ACK)
+            {
+              NS_FATAL_ERROR ("Sending Block Acks in an MU DL PPDU is not supported yet");
+            }
+
+          params.SetUlMuAckSequenceType (m_ulMuAckSequence);
+          BlockAckType baType = BlockAckType::MULTI_STA;
           for (auto& userInfo : m_txVector.GetHeMuUserInfoMap ())
             {
               auto addressIt = m_apMac->GetStaList ().find (userInfo.first);
@@ -222,80 +719,72 @@ RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
                 }
             }
         }
-      else
-        {
-          NS_FATAL_ERROR ("Sending Block Acks in an MU DL PPDU is not supported yet");
-        }
 
-      CtrlTriggerHeader trigger (TriggerFrameType::BASIC_TRIGGER, m_txVector);
+      CtrlTriggerHeader trigger (m_ulTriggerType, m_txVector);
 
       // compute the maximum amount of time that can be granted to stations.
       // This value is limited by the max PPDU duration
       Time maxDuration = GetPpduMaxTime (m_txVector.GetPreambleType ());
 
-      // compute the time required by stations based on the buffer status reports, if any
-      uint32_t maxBufferSize = 0;
-
+      // compute the time required by every user to transmit the frames it reported
+      // in its buffer status on the RU it has been assigned
+      std::vector<std::pair<uint16_t, Time>> userTxTimes;
+      Time bufferTxTime = Seconds (0);
       for (auto& userInfo : m_txVector.GetHeMuUserInfoMap ())
         {
-          auto addressIt = m_apMac->GetStaList ().find (userInfo.first);
-          if (addressIt != m_apMac->GetStaList ().end ())
-            {
-              uint8_t queueSize = m_apMac->GetMaxBufferStatus (addressIt->second);
-              if (queueSize == 255)
-                {
-                  NS_LOG_DEBUG ("Buffer status of station " << addressIt->second << " is unknown");
-                  maxBufferSize = std::max (maxBufferSize, m_ulPsduSize);
-                }
-              else if (queueSize == 254)
-                {
-                  NS_LOG_DEBUG ("Buffer status of station " << addressIt->second << " is not limited");
-                  maxBufferSize = 0xffffffff;
-                  break;
-                }
-              else
-                {
-                  NS_LOG_DEBUG ("Buffer status of station " << addressIt->second << " is " << +queueSize);
-                  maxBufferSize = std::max (maxBufferSize, static_cast<uint32_t> (queueSize * 256));
-                }
-            }
-          else
-            {
-              NS_LOG_WARN ("Maybe station with AID=" << userInfo.first << " left the BSS since the last MU DL transmission?");
-            }
+          // the duration of the HE TB PPDU is set in the Trigger Frame, hence it is
+          // computed from the exact size (buffer status units or a QoS Null frame)
+          Time txTime = GetMuPsduDuration (m_staTable.ulBuffer[userInfo.first], m_txVector, userInfo.first, true);
+          userTxTimes.push_back ({userInfo.first, txTime});
+          bufferTxTime = std::max (bufferTxTime, txTime);
         }
 
-      // if the maximum buffer size is 0, skip UL OFDMA and proceed with trying DL OFDMA
-      if (maxBufferSize > 0)
+      // if no user was selected, skip UL OFDMA and proceed with trying DL OFDMA
+      if (!userTxTimes.empty ())
         {
           // if we are within a TXOP, we have to consider the response time and the
           // remaining TXOP duration
           if (txop->GetTxopLimit ().IsStrictlyPositive ())
             {
-              // we need to define the HE TB (trigger based) PPDU duration in order to compute the response to
-              // the Trigger Frame. Let's use 1 ms for this purpose. We'll subtract it later.
-              uint16_t length = WifiPhy::ConvertHeTbPpduDurationToLSigLength (MilliSeconds (1),
-                                                                              m_low->GetPhy ()->GetFrequency ());
-              trigger.SetUlLength (length);
-
-              Ptr<Packet> packet = Create<Packet> ();
-              packet->AddHeader (trigger);
-              WifiMacHeader hdr;
-              hdr.SetType (WIFI_MAC_CTL_TRIGGER);
-              hdr.SetAddr1 (Mac48Address::GetBroadcast ());
-              Ptr<WifiMacQueueItem> item = Create<WifiMacQueueItem> (packet, hdr);
-
-              Time response = m_low->GetResponseDuration (params, m_txVector, item);
-
-              // Add the time to transmit the Trigger Frame itself
-              WifiTxVector txVector = GetWifiRemoteStationManager ()->GetRtsTxVector (hdr.GetAddr1 (), &hdr, packet);
-
-              response += m_low->GetPhy ()->CalculateTxDuration (item->GetSize (), txVector,
-                                                                 m_low->GetPhy ()->GetFrequency ());
-
-              // Subtract the duration of the HE TB PPDU
-              response -= WifiPhy::ConvertLSigLengthToHeTbPpduDuration (length, m_txVector,
-                                                                        m_low->GetPhy ()->GetFrequency ());
+              // the response time only depends on the users of the last DL MU PPDU
+              // and on the ack sequence, hence it is cached
+              AirtimeKey key = GetAirtimeKey (m_ulTriggerType == TriggerFrameType::BSRP_TRIGGER
+                                              ? UL_BSRP_RESPONSE : UL_RESPONSE,
+                                              m_ulMuAckSequence, m_txVector);
+              int64_t cached;
+              Time response;
+              if (FindAirtime (key, cached))
+                {
+                  response = TimeStep (cached);
+                }
+              else
+                {
+                  // we need to define the HE TB (trigger based) PPDU duration in order to compute the response to
+                  // the Trigger Frame. Let's use 1 ms for this purpose. We'll subtract it later.
+                  uint16_t length = WifiPhy::ConvertHeTbPpduDurationToLSigLength (MilliSeconds (1),
+                                                                                  m_low->GetPhy ()->GetFrequency ());
+                  trigger.SetUlLength (length);
+
+                  Ptr<Packet> packet = Create<Packet> ();
+                  packet->AddHeader (trigger);
+                  WifiMacHeader hdr;
+                  hdr.SetType (WIFI_MAC_CTL_TRIGGER);
+                  hdr.SetAddr1 (Mac48Address::GetBroadcast ());
+                  Ptr<WifiMacQueueItem> item = Create<WifiMacQueueItem> (packet, hdr);
+
+                  response = m_low->GetResponseDuration (params, m_txVector, item);
+
+                  // Add the time to transmit the Trigger Frame itself
+                  WifiTxVector txVector = GetWifiRemoteStationManager ()->GetRtsTxVector (hdr.GetAddr1 (), &hdr, packet);
+
+                  response += m_low->GetPhy ()->CalculateTxDuration (item->GetSize (), txVector,
+                                                                     m_low->GetPhy ()->GetFrequency ());
+
+                  // Subtract the duration of the HE TB PPDU
+                  response -= WifiPhy::ConvertLSigLengthToHeTbPpduDuration (length, m_txVector,
+                                                                            m_low->GetPhy ()->GetFrequency ());
+                  StoreAirtime (key, response.GetTimeStep ());
+                }
 
               if (response > txop->GetTxopRemaining ())
                 {
@@ -303,16 +792,14 @@ RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
                   // In this way, no transmission will occur now and the next time we will try again
                   // performing an UL OFDMA transmission.
                   NS_LOG_DEBUG ("Remaining TXOP duration is not enough for UL MU exchange");
-                  m_staInfo.clear ();
+                  m_metrics->Increment (RrOfdmaMetrics::TXOP_SHORTAGE_FALLBACKS);
+                  m_candidates.clear ();
                   return DL_OFDMA;
                 }
 
               maxDuration = Min (maxDuration, txop->GetTxopRemaining () - response);
             }
 
-          Time bufferTxTime = m_low->GetPhy ()->CalculateTxDuration (maxBufferSize, m_txVector,
-                                                                     m_low->GetPhy ()->GetFrequency (),
-                                                                     trigger.begin ()->GetAid12 ());
           if (bufferTxTime < maxDuration)
             {
               // the maximum buffer size can be transmitted within the allowed time
@@ -320,18 +807,22 @@ RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
             }
           else
             {
-              // maxDuration may be a too short time. If it does not allow to transmit
+              // maxDuration may be a too short time. If it does not allow every user
+              // (and hence the one on the smallest RU or at the lowest MCS) to transmit
               // at least m_ulPsduSize bytes, give up the UL MU transmission for now
-              Time minDuration = m_low->GetPhy ()->CalculateTxDuration (m_ulPsduSize, m_txVector,
-                                                                        m_low->GetPhy ()->GetFrequency (),
-                                                                        trigger.begin ()->GetAid12 ());
+              Time minDuration = Seconds (0);
+              for (auto& user : userTxTimes)
+                {
+                  minDuration = Max (minDuration, GetMuPsduDuration (m_ulPsduSize, m_txVector, user.first, true));
+                }
               if (maxDuration < minDuration)
                 {
                   // maxDuration is a too short time. Reset m_staInfo and return DL_OFDMA.
                   // In this way, no transmission will occur now and the next time we will try again
                   // performing an UL OFDMA transmission.
                   NS_LOG_DEBUG ("Available time " << maxDuration << " is too short");
-                  m_staInfo.clear ();
+                  m_metrics->Increment (RrOfdmaMetrics::SHORT_MAX_DURATION_FALLBACKS);
+                  m_candidates.clear ();
                   return DL_OFDMA;
                 }
             }
@@ -342,33 +833,61 @@ RrOfdmaManager::SelectTxFormat (Ptr<const WifiMacQueueItem> mpdu)
                                                                           m_low->GetPhy ()->GetFrequency ());
           m_txVector.SetLength (length);
           m_txParams = params;
+          m_ulStartStation = nextUlStation;
+          m_lastUlBsrp = (m_ulTriggerType == TriggerFrameType::BSRP_TRIGGER);
+          if (m_ulTriggerType == TriggerFrameType::BSRP_TRIGGER)
+            {
+              // the buffer status of the solicited stations is not solicited again
+              // before it becomes stale, even if they do not respond
+              for (auto& user : userTxTimes)
+                {
+                  m_staTable.lastBsr[user.first] = Simulator::Now ();
+                }
+              m_metrics->Increment (RrOfdmaMetrics::BSRP_TRIGGERS);
+            }
+          else
+            {
+              // users whose frames take less than maxDuration pad the rest of the HE TB PPDU
+              for (auto& user : userTxTimes)
+                {
+                  double padding = 1 - std::min (user.second, maxDuration).GetSeconds () / maxDuration.GetSeconds ();
+                  NS_LOG_DEBUG ("Padding ratio of UL user with AID=" << user.first << ": " << padding);
+                  m_metrics->Record (RrOfdmaMetrics::UL_PADDING_PERCENT, std::lround (padding * 100));
+                }
+            }
+          m_metrics->Record (RrOfdmaMetrics::USERS_PER_PPDU, m_txVector.GetHeMuUserInfoMap ().size ());
+          for (auto& userInfo : m_txVector.GetHeMuUserInfoMap ())
+            {
+              m_metrics->Record (RrOfdmaMetrics::RU_SIZE, GetNTones (userInfo.second.ru.ruType));
+            }
+          NotifyDecision (UL_OFDMA, true);
           return UL_OFDMA;
         }
     }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  if (!m_tracesConnected)
+    {
+      ConnectTraces ();
+    }
 
   // get the list of associated stations ((AID, MAC address) pairs)
   const std::map<uint16_t, Mac48Address>& staList = m_apMac->GetStaList ();
+  UpdateStationTable (staList);
   auto startIt = staList.find (m_startStation);
 
-std::cout<<"SelectTxFormat: sta list size"<<staList.size()<<"\n";
-std::cout<<"SelectTxFormat: start station"<<m_startStation<<"\n";
-std::cout<<"SelectTxFormat: total station"<<m_nStations<<"\n";
 
   // This may be the first invocation or the starting station left
   if (startIt == staList.end ())
     {
       startIt = staList.begin ();
       m_startStation = startIt->first;
-std::cout<<"SelectTxFormat: if (startIt == staList.end ()),  start station"<<m_startStation<<"\n";
 
     }
 
 
   uint8_t currTid = mpdu->GetHeader ().GetQosTid ();
   AcIndex primaryAc = QosUtilsMapTidToAc (currTid);
-  m_staInfo.clear ();
+  m_candidates.clear ();
 
   // If the primary AC holds a TXOP, we can select a station as a receiver of
   // the MU PPDU only if the AP has frames to send to such station that fit into
@@ -390,74 +909,108 @@ std::cout<<"SelectTxFormat: if (startIt == staList.end ()),  start station"<<m_s
 
   NS_ASSERT (count >= 1);
 
-  std::map<Mac48Address, DlPerStaInfo> guess;
-  auto staIt = startIt;
-  do
-    {
-      guess[staIt->second] = {staIt->first, currTid};
-      if (++staIt == staList.end ())
-        {
-          staIt = staList.begin ();
-        }
-    } while (guess.size () < count && staIt != startIt);
-
-
   Ptr<WifiAckPolicySelector> ackSelector = m_qosTxop[primaryAc]->GetAckPolicySelector ();
   NS_ASSERT (ackSelector != 0);
   m_dlMuAckSequence = ackSelector->GetAckSequenceForDlMu ();
-  
-//This call doesn't matter for our use case because this function is called again from compute dl ofdma which again finds the tx vector and params
-InitTxVectorAndParams (guess, ruType, m_dlMuAckSequence);
 
   // if the AC owns a TXOP, compute the time available for the transmission of data frames
   Time txopLimit = Seconds (0);
+  if (m_txopUserRotation)
+    {
+      UpdateTxopState (m_qosTxop[primaryAc]->GetTxopLimit ().IsStrictlyPositive ()
+                       ? m_qosTxop[primaryAc]->GetTxopRemaining () : Seconds (0));
+    }
   if (m_qosTxop[primaryAc]->GetTxopLimit ().IsStrictlyPositive ())
     {
-      // TODO Account for MU-RTS/CTS when implemented
-      CtrlTriggerHeader trigger;
-
-      if (m_dlMuAckSequence == DlMuAckSequenceType::DL_MU_BAR
-          || m_dlMuAckSequence == DlMuAckSequenceType::DL_AGGREGATE_TF)
+      std::map<Mac48Address, DlPerStaInfo> guess;
+      auto staIt = startIt;
+      do
         {
-          // Need to prepare the MU-BAR to correctly get the response time
-          trigger = GetTriggerFrameHeader (m_txVector, 5);
-          trigger.SetUlLength (m_low->CalculateUlLengthForBlockAcks (trigger, m_txParams));
-        }
-      txopLimit = m_qosTxop[primaryAc]->GetTxopRemaining () - GetResponseDuration (m_txParams, m_txVector, trigger);
+          guess[staIt->second] = {staIt->first, currTid};
+          if (++staIt == staList.end ())
+            {
+              staIt = staList.begin ();
+            }
+        } while (guess.size () < count && staIt != startIt);
+
+      // the actual TX vector is only built once by ComputeDlOfdmaInfo
+      Time response = GetDlMuResponseDuration (guess, ruType, m_dlMuAckSequence);
+      txopLimit = m_qosTxop[primaryAc]->GetTxopRemaining () - response;
 
       if (txopLimit.IsNegative ())
         {
+          m_metrics->Increment (RrOfdmaMetrics::TXOP_SHORTAGE_FALLBACKS);
           if (m_forceDlOfdma)
             {
               NS_LOG_DEBUG ("Not enough TXOP remaining time: return DL_OFDMA with empty set of receiver stations");
               return OfdmaTxFormat::DL_OFDMA;
             }
           NS_LOG_DEBUG ("Not enough TXOP remaining time: return NON_OFDMA");
+          NotifyDecision (OfdmaTxFormat::NON_OFDMA, false);
           return OfdmaTxFormat::NON_OFDMA;
         }
     }
 
-
-/////////////////////////////////////////////////////////////////
-dataStaPair1.clear(); 
-v_QosType.clear();
-v_powerLevel.clear();
-v_dataStaPair.clear();
-finalStaPairIndex.clear();
+  // maximum duration of the DL MU PPDU, used to estimate how many bytes each
+  // station can receive in the RU it may be assigned
+  m_maxDlDuration = GetPpduMaxTime (WIFI_PREAMBLE_HE_MU);
+  if (txopLimit.IsStrictlyPositive ())
+    {
+      m_maxDlDuration = Min (m_maxDlDuration, txopLimit);
+    }
 
 
-  do
+  // only the stations the AP has frames to send to are visited, starting from the
+  // round robin cursor. AIDs are copied because peeking frames may drop expired
+  // frames from the queues and hence update the set of backlogged stations
+  std::vector<uint16_t> backlogged;
+  backlogged.reserve (m_backlogged.size ());
+  auto cursor = m_backlogged.lower_bound (m_startStation);
+  backlogged.insert (backlogged.end (), cursor, m_backlogged.end ());
+  backlogged.insert (backlogged.end (), m_backlogged.begin (), cursor);
+  // stations already served in the current TXOP are visited after all the others
+  std::stable_partition (backlogged.begin (), backlogged.end (),
+                         [this] (uint16_t aid) { return !IsServedInTxop (aid); });
+
+  // the equal split serves the first NStations candidates in round robin order,
+  // whereas weighted policies pick the NStations candidates with the highest
+  // weight, hence all the backlogged stations are candidates
+  std::size_t maxCandidates = (GetDlSchedulingPolicy (m_schedulingPolicy).IsEqualSplit ()
+                               ? m_nStations : backlogged.size ());
+  std::size_t nVisited = 0;
+  for (; nVisited < backlogged.size () && m_candidates.size () < maxCandidates; nVisited++)
     {
-      NS_LOG_DEBUG ("Next candidate STA (MAC=" << startIt->second << ", AID=" << startIt->first << ")");
-      // check if the AP has at least one frame to be sent to the current station
+      auto staIt = staList.find (backlogged[nVisited]);
+      if (staIt == staList.end ())
+        {
+          // frames are still queued for a station that left the BSS
+          continue;
+        }
+
+      NS_LOG_DEBUG ("Next candidate STA (MAC=" << staIt->second << ", AID=" << staIt->first << ")");
+      // among the TIDs for which the AP has a frame meeting the size and time
+      // limits, select the one with the most queued bytes, so that the RU of the
+      // station is filled rather than padded. The TID of the AC that gained access
+      // to the channel is visited first, so that it is selected in case of a tie
+      uint16_t aid = staIt->first;
+      uint8_t pendingTids = m_staTable.backlogTids[aid];
+      Ptr<const WifiMacQueueItem> bestMpdu;
+      uint8_t bestTid = 0;
+      uint32_t bestBytes = 0;
       for (uint8_t tid : std::initializer_list<uint8_t> {currTid, 1, 2, 0, 3, 4, 5, 6, 7})
         {
+          if ((pendingTids & (1 << tid)) == 0)
+            {
+              continue;
+            }
+          pendingTids &= ~(1 << tid);
+
           AcIndex ac = QosUtilsMapTidToAc (tid);
           // check that a BA agreement is established with the receiver for the
           // considered TID, since ack sequences for DL MU PPDUs require block ack
-          if (ac >= primaryAc && m_qosTxop[ac]->GetBaAgreementEstablished (startIt->second, tid))
+          if (ac >= primaryAc && m_qosTxop[ac]->GetBaAgreementEstablished (staIt->second, tid))
             {
-              mpdu = m_qosTxop[ac]->PeekNextFrame (tid, startIt->second);
+              mpdu = m_qosTxop[ac]->PeekNextFrame (tid, staIt->second);
 
               // we only check if the first frame of the current TID meets the size
               // and duration constraints. We do not explore the queues further.
@@ -467,80 +1020,62 @@ finalStaPairIndex.clear();
                   // candidate station to check if the MPDU meets the size and time limits.
                   // An RU of the computed size is tentatively assigned to the candidate
                   // station, so that the TX duration can be correctly computed.
-                  WifiTxVector suTxVector = m_low->GetDataTxVector (mpdu),
-                               muTxVector;
+                  WifiTxVector suTxVector = GetSuTxVector (aid, mpdu);
+                  WifiTxVector muTxVector;
 
                   muTxVector.SetPreambleType (WIFI_PREAMBLE_HE_MU);
                   muTxVector.SetChannelWidth (m_low->GetPhy ()->GetChannelWidth ());
                   muTxVector.SetGuardInterval (m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ());
-                  muTxVector.SetHeMuUserInfo (startIt->first,
+                  muTxVector.SetHeMuUserInfo (aid,
                                               {{false, ruType, 1}, suTxVector.GetMode (), suTxVector.GetNss ()});
 
                   if (m_low->IsWithinSizeAndTimeLimits (mpdu, muTxVector, 0, txopLimit))
                     {
+                      // frames queued before the station entered the station table are
+                      // not accounted for, hence at least the first frame is counted
+                      uint32_t bytes = std::max (m_staTable.queuedBytes[aid][tid], mpdu->GetPacket ()->GetSize ());
+                      NS_LOG_DEBUG ("STA with AID=" << aid << " has " << bytes << " bytes queued with TID=" << +tid);
+                      if (bestMpdu == 0 || bytes > bestBytes)
+                        {
+                          bestMpdu = mpdu;
+                          bestTid = tid;
+                          bestBytes = bytes;
+                        }
+                    }
+                }
+              else
+                {
+                  NS_LOG_DEBUG ("No frames to send to " << staIt->second << " with TID=" << +tid);
+                }
+            }
+        }
 
-                      int type_Qos;
-                      if(ac==AC_VO){
-                        type_Qos=1;
-                      }
-                      else if(ac==AC_BE)
-                      {
-                        type_Qos=3;
-                      }
-                      else if(ac==AC_VI)
-                      {
-                        type_Qos=2;
-                      }
-                      else{
-                        type_Qos=4;
-                      }
-
-                      double txpowerstart=powww.GetTxPowerStart();
-
-                      v_QosType.push_back(type_Qos);
-                      v_powerLevel.push_back(txpowerstart);
-                       v_dataStaPair.push_back(mpdu->GetPacket()->GetSize());
-
-  //                      for(unsigned int i=0;i<v_dataStaPair.size();i++){
-  // std::cout<<"\n\n vector data of station"<<v_dataStaPair[i];
-//}
-
+      if (bestMpdu != 0)
+        {
+          AcIndex ac = QosUtilsMapTidToAc (bestTid);
+          int type_Qos = (ac == AC_VO ? 1 : ac == AC_VI ? 2 : ac == AC_BE ? 3 : 4);
+
+          // store the state of the candidate station in the station table
+          WifiTxVector suTxVector = GetSuTxVector (aid, bestMpdu);
+          m_staTable.tid[aid] = bestTid;
+          m_staTable.qosType[aid] = type_Qos;
+          m_staTable.backlog[aid] = bestBytes;
+          m_staTable.holSize[aid] = bestMpdu->GetSize ();
+          // head-of-line delay of the station, i.e., the time the frame
+          // we peeked has been waiting in the queue
+          m_staTable.holDelay[aid] = (Simulator::Now () - bestMpdu->GetTimeStamp ()).GetSeconds ();
+          m_staTable.mcs[aid] = suTxVector.GetMode ().GetMcsValue ();
+          m_staTable.nss[aid] = suTxVector.GetNss ();
+          m_staTable.instRate[aid] = GetInstantaneousRate (aid, suTxVector);
+
+          // the frame meets the constraints, add the station to the list
+          NS_LOG_DEBUG ("Adding candidate STA (MAC=" << staIt->second << ", AID="
+                        << aid << ") TID=" << +bestTid);
+          m_candidates.push_back (aid);
+        }
+    }
 
-
-
-
-
-
-
-
-
-
-
-
-                      // the frame meets the constraints, add the station to the list
-                      NS_LOG_DEBUG ("Adding candidate STA (MAC=" << startIt->second << ", AID="
-                                    << startIt->first << ") TID=" << +tid);
-                      DlPerStaInfo info {startIt->first, tid};
-                      m_staInfo.push_back (std::make_pair (startIt->second, info));
-                      break;    // terminate the for loop
-                    }
-                }
-              else
-                {
-                  NS_LOG_DEBUG ("No frames to send to " << startIt->second << " with TID=" << +tid);
-                }
-            }
-        }
-
-      // move to the next station in the map
-      startIt++;
-      if (startIt == staList.end ())
-        {
-          startIt = staList.begin ();
-        }
-    } while (m_staInfo.size () < m_nStations && startIt->first != m_startStation);
-
-  if (m_staInfo.empty ())
+  if (m_candidates.empty ())
     {
       if (m_forceDlOfdma)
         {
@@ -548,18 +1083,15 @@ finalStaPairIndex.clear();
           return OfdmaTxFormat::DL_OFDMA;
         }
       NS_LOG_DEBUG ("The AP does not have suitable frames to transmit: return NON_OFDMA");
+      NotifyDecision (OfdmaTxFormat::NON_OFDMA, false);
       return OfdmaTxFormat::NON_OFDMA;
     }
 
 
 
-for(unsigned int i=0;i<v_dataStaPair.size();i++){
-  std::cout<<"\n\n vector data of station"<<v_dataStaPair[i];
-}
-
-
 
-  m_startStation = startIt->first;
+  // the first station to visit next time is the first one not visited this time
+  m_startStation = backlogged[nVisited % backlogged.size ()];
   return OfdmaTxFormat::DL_OFDMA;
 }
 
@@ -616,621 +1148,1548 @@ NS_LOG_FUNCTION("ru type---------------------: "<<ruType);
 
 
 
-double RrOfdmaManager::calculate_a_i(int type_of_Application)
+double
+RrOfdmaManager::calculate_a_i (int type_of_Application)
 {
-  std::cout<<"\ncalculating Type of Application";
-  double a_i;
-  switch(type_of_Application){
+  // weight of the access category: voice (1), video (2), best effort (3)
+  // and background (4). Unknown types are given the lowest weight
+  switch (type_of_Application)
+    {
     case 1:
-    a_i=16;
-    //a_i=-(log10(10)/100);
-    break;
-
+      return 16;
     case 2:
-    a_i=8;
-    //a_i=-(log10(20)/150);
-    break;
-
+      return 8;
     case 3:
-    a_i=4;
-    //a_i=-(log10(20)/300);
-    break;
-
-    case 4:
-    a_i=2;
-    //a_i=-(log10(20)/400);
-    break;
+      return 4;
     default:
-    break;
-  }
-  return a_i;
-    
-
-}
-double RrOfdmaManager::averageChannelcapacity()
-{
-  std::cout<<"\ncalculating average channel capacity";
-  // auto a=powerLevel.begin();
-  double avg_channel_capacity;
-  // while(a!=powerLevel.end())
-  // {
-  //     avg_channel_capacity+= a->first;
-  //     a++;
-  // }
+      return 2;
+    }
+}
 
-for(unsigned int i = 0; i<v_powerLevel.size();i++){
-avg_channel_capacity+= v_powerLevel[i];
-  //     
+void
+RrOfdmaManager::NotifyPsduForwardedDown (WifiPsduMap psduMap, WifiTxVector txVector)
+{
+  for (auto& psdu : psduMap)
+    {
+      if (!psdu.second->GetAddr1 ().IsGroup () && psdu.second->GetHeader (0).IsQosData ())
+        {
+          uint16_t aid = GetAid (psdu.second->GetAddr1 ());
+          if (aid != 0)
+            {
+              UpdateAverageRate (aid, psdu.second->GetSize ());
+              if (!txVector.IsMu ())
+                {
+                  // this is the TX vector currently selected by the remote station
+                  // manager for SU transmissions to the station
+                  m_staTable.suTxVector[aid] = txVector;
+                  m_staTable.suTxVectorTime[aid] = Simulator::Now ();
+                }
+            }
+        }
+    }
+}
 
+const WifiTxVector&
+RrOfdmaManager::GetMuTxVectorTemplate (void)
+{
+  uint16_t channelWidth = m_low->GetPhy ()->GetChannelWidth ();
+  uint16_t guardInterval = m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ();
+  uint16_t frequency = m_low->GetPhy ()->GetFrequency ();
+
+  if (m_muTxVectorTemplate.GetPreambleType () != WIFI_PREAMBLE_HE_MU
+      || m_muTxVectorTemplate.GetChannelWidth () != channelWidth
+      || m_muTxVectorTemplate.GetGuardInterval () != guardInterval
+      || m_phyFrequency != frequency)
+    {
+      NS_LOG_DEBUG ("Building the template of the DL MU TX vector");
+      m_muTxVectorTemplate = WifiTxVector ();
+      m_muTxVectorTemplate.SetPreambleType (WIFI_PREAMBLE_HE_MU);
+      m_muTxVectorTemplate.SetChannelWidth (channelWidth);
+      m_muTxVectorTemplate.SetGuardInterval (guardInterval);
+      m_muTxVectorTemplate.SetTxPowerLevel (GetWifiRemoteStationManager ()->GetDefaultTxPowerLevel ());
+      m_phyFrequency = frequency;
+      // cached durations depend on the PHY configuration
+      NS_LOG_DEBUG ("Clearing the airtime cache (" << m_airtimeCache.size () << " entries)");
+      m_airtimeCache.clear ();
+    }
+  return m_muTxVectorTemplate;
 }
 
-  return (avg_channel_capacity/v_powerLevel.size());
+WifiTxVector
+RrOfdmaManager::GetEstimateTxVector (const std::vector<uint16_t>& stations, HeRu::RuType ruType,
+                                     bool useMappedRus)
+{
+  NS_LOG_FUNCTION (this << stations.size () << ruType << useMappedRus);
+
+  WifiTxVector txVector = GetMuTxVectorTemplate ();
+  for (auto& aid : stations)
+    {
+      HeRu::RuType type = ruType;
+      auto ruTypeIt = mappedRuAllocated.find (aid);
+      if (useMappedRus && ruTypeIt != mappedRuAllocated.end ())
+        {
+          type = ruTypeIt->second;
+        }
+      uint8_t mcs = GetMuMcs (aid, type, m_staTable.mcs[aid]);
+      txVector.SetHeMuUserInfo (aid, {{false, type, 1}, WifiPhy::GetHeMcs (mcs), m_staTable.nss[aid]});
+    }
+  return txVector;
 }
 
-WifiSpectrumBand
-RrOfdmaManager::GetBand (uint16_t bandWidth, uint8_t /*bandIndex*/)
+bool
+RrOfdmaManager::AirtimeKey::operator< (const AirtimeKey& other) const
 {
-  WifiSpectrumBand band;
-  band.first = 0;
-  band.second = 0;
-  return band;
+  return std::tie (kind, channelWidth, guardInterval, ackSequence, users, target, bytes)
+         < std::tie (other.kind, other.channelWidth, other.guardInterval, other.ackSequence,
+                     other.users, other.target, other.bytes);
 }
 
+uint64_t
+RrOfdmaManager::PackAirtimeUser (HeRu::RuType ruType, uint8_t mcs, uint8_t nss, uint32_t ack)
+{
+  return (static_cast<uint64_t> (ack) << 32) | (static_cast<uint64_t> (ruType) << 16)
+         | (static_cast<uint64_t> (mcs) << 8) | nss;
+}
 
+uint32_t
+RrOfdmaManager::PackAirtimeAck (const BlockAckReqType& barType, const BlockAckType& baType)
+{
+  uint32_t bitmapLen = 0;
+  for (auto len : baType.m_bitmapLen)
+    {
+      bitmapLen += len;
+    }
+  return (static_cast<uint32_t> (barType.m_variant) << 24) | (static_cast<uint32_t> (baType.m_variant) << 16)
+         | std::min<uint32_t> (bitmapLen, 0xffff);
+}
 
-void RrOfdmaManager::RuAlloc(int number_of_clients)
+void
+RrOfdmaManager::GetBlockAckTypes (Mac48Address address, uint8_t tid, BlockAckReqType& barType,
+                                  BlockAckType& baType)
 {
+  Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (tid)];
+  barType = txop->GetBaAgreementEstablished (address, tid)
+            ? txop->GetBlockAckReqType (address, tid)
+            : BlockAckReqType::COMPRESSED;
+  baType = txop->GetBaAgreementEstablished (address, tid)
+           ? txop->GetBlockAckType (address, tid)
+           : BlockAckType::COMPRESSED;
+}
 
-  std::cout<<"\n Inside RU Alloca\n "<<number_of_clients;
-  //std::vector<int> RuSet;
+RrOfdmaManager::AirtimeKey
+RrOfdmaManager::GetAirtimeKey (AirtimeKind kind, uint8_t ackSequence, std::vector<uint64_t> users,
+                               uint32_t bytes, uint64_t target)
+{
+  const WifiTxVector& muTxVector = GetMuTxVectorTemplate ();
 
-  if(number_of_clients>0){
-switch(number_of_clients){
-  case 1:
-  finalRUAlloc.push_back(242);
-  break;
+  // the order of the users does not matter
+  std::sort (users.begin (), users.end ());
+  return {kind, muTxVector.GetChannelWidth (), muTxVector.GetGuardInterval (), ackSequence,
+          users, target, bytes};
+}
 
-  case 2:
-  finalRUAlloc.push_back(106);
-  finalRUAlloc.push_back(106);
- // RuSet.push_back(26);
-  break;
+RrOfdmaManager::AirtimeKey
+RrOfdmaManager::GetAirtimeKey (AirtimeKind kind, uint8_t ackSequence, const WifiTxVector& txVector,
+                               uint32_t bytes, uint16_t staId)
+{
+  std::vector<uint64_t> users;
+  uint64_t target = 0;
 
-  case 3:
-  finalRUAlloc.push_back(106);
-  finalRUAlloc.push_back(106);
-  finalRUAlloc.push_back(26);
-  break;
+  for (auto& userInfo : txVector.GetHeMuUserInfoMap ())
+    {
+      uint64_t user = PackAirtimeUser (userInfo.second.ru.ruType, userInfo.second.mcs.GetMcsValue (),
+                                       userInfo.second.nss);
+      users.push_back (user);
+      if (userInfo.first == staId)
+        {
+          target = user;
+        }
+    }
+  return GetAirtimeKey (kind, ackSequence, users, bytes, target);
+}
 
-  case 4:
-  finalRUAlloc.push_back(106);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(26);
-  break;
+bool
+RrOfdmaManager::FindAirtime (const AirtimeKey& key, int64_t& value)
+{
+  auto it = m_airtimeCache.find (key);
+  if (it == m_airtimeCache.end ())
+    {
+      m_metrics->Increment (RrOfdmaMetrics::AIRTIME_CACHE_MISSES);
+      return false;
+    }
+  m_metrics->Increment (RrOfdmaMetrics::AIRTIME_CACHE_HITS);
+  value = it->second;
+  return true;
+}
 
-  case 5:
-  finalRUAlloc.push_back(106);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
- break;
+void
+RrOfdmaManager::StoreAirtime (const AirtimeKey& key, int64_t value)
+{
+  if (m_airtimeCache.size () >= AIRTIME_CACHE_MAX_ENTRIES)
+    {
+      NS_LOG_DEBUG ("Clearing the airtime cache (" << m_airtimeCache.size () << " entries)");
+      m_airtimeCache.clear ();
+    }
+  m_airtimeCache[key] = value;
+}
 
-case 6:
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26); // other combination are also there
-  break;
+Time
+RrOfdmaManager::GetMuPsduDuration (uint32_t size, const WifiTxVector& txVector, uint16_t staId, bool exact)
+{
+  // for estimates, the size is rounded up to a multiple of the bucket size, so
+  // that the returned duration is never shorter than the actual one
+  uint32_t bytes = size;
+  if (!exact)
+    {
+      bytes = static_cast<uint32_t> (std::min<uint64_t> ((size + AIRTIME_BYTE_BUCKET - 1ULL)
+                                                         / AIRTIME_BYTE_BUCKET * AIRTIME_BYTE_BUCKET,
+                                                         0xffffffff));
+    }
+  AirtimeKey key = GetAirtimeKey (MU_PSDU_DURATION, 0, txVector, bytes, staId);
+  int64_t cached;
 
-  case 7:
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  break;
+  if (FindAirtime (key, cached))
+    {
+      return TimeStep (cached);
+    }
 
-  case 8:
-  finalRUAlloc.push_back(52);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  finalRUAlloc.push_back(26);
-  break;
+  Time duration = m_low->GetPhy ()->CalculateTxDuration (bytes, txVector, m_low->GetPhy ()->GetFrequency (),
+                                                         staId);
+  StoreAirtime (key, duration.GetTimeStep ());
+  return duration;
+}
 
+uint16_t
+RrOfdmaManager::GetUlLengthForBlockAcks (const CtrlTriggerHeader& trigger, const WifiTxVector& txVector,
+                                         const std::map<Mac48Address, DlPerStaInfo>& staList)
+{
+  // the length of the Block Acks depends on the BlockAck agreement of each user
+  std::vector<uint64_t> users;
+  for (auto& userInfo : txVector.GetHeMuUserInfoMap ())
+    {
+      Mac48Address address = m_staTable.address[userInfo.first];
+      BlockAckReqType barType;
+      BlockAckType baType;
+      GetBlockAckTypes (address, staList.at (address).tid, barType, baType);
+      users.push_back (PackAirtimeUser (userInfo.second.ru.ruType, userInfo.second.mcs.GetMcsValue (),
+                                        userInfo.second.nss, PackAirtimeAck (barType, baType)));
+    }
+  AirtimeKey key = GetAirtimeKey (DL_BA_LENGTH, m_txParams.GetDlMuAckSequenceType (), users);
+  int64_t cached;
 
-  default:
- for(int i=0;i<9;i++){
-  finalRUAlloc.push_back(26);
- }
-break;
+  if (FindAirtime (key, cached))
+    {
+      return static_cast<uint16_t> (cached);
+    }
 
+  uint16_t length = m_low->CalculateUlLengthForBlockAcks (trigger, m_txParams);
+  StoreAirtime (key, length);
+  return length;
 }
 
+void
+RrOfdmaManager::NotifyTxFailed (Mac48Address address)
+{
+  uint16_t aid = GetAid (address);
+  if (aid != 0)
+    {
+      // the remote station manager may select a different rate next time
+      m_staTable.suTxVectorTime[aid] = Time::Min ();
+      // and the failed PSDU does not contribute to the rate the station is served at
+      RevertAverageRate (aid);
+    }
 }
-else{
-  std::cout<<"No client to allocate Resources";
-  
 
+WifiTxVector
+RrOfdmaManager::GetSuTxVector (uint16_t aid, Ptr<const WifiMacQueueItem> mpdu)
+{
+  NS_ASSERT (mpdu->GetHeader ().GetAddr1 () == m_staTable.address[aid]);
+
+  if (m_staTable.suTxVectorTime[aid] == Time::Min ()
+      || Simulator::Now () - m_staTable.suTxVectorTime[aid] > m_suTxVectorTimeout)
+    {
+      m_staTable.suTxVector[aid] = m_low->GetDataTxVector (mpdu);
+      m_staTable.suTxVectorTime[aid] = Simulator::Now ();
+    }
+  return m_staTable.suTxVector[aid];
 }
+
+void
+RrOfdmaManager::UpdateAverageRate (uint16_t aid, uint32_t bytes)
+{
+  // the average is decayed lazily, i.e., only when it is updated or read, so that
+  // stations that are not served do not need to be visited
+  Time now = Simulator::Now ();
+  m_staTable.avgRate[aid] = GetAverageRate (aid) + bytes * 8 / m_avgRateTau.GetSeconds ();
+  m_staTable.lastServed[aid] = now;
+  m_staTable.lastCredit[aid] = bytes;
 }
 
+void
+RrOfdmaManager::RevertAverageRate (uint16_t aid)
+{
+  // the credit has been decayed along with the rest of the average since it was
+  // given, hence it is removed before the average is decayed any further
+  double credit = m_staTable.lastCredit[aid] * 8 / m_avgRateTau.GetSeconds ();
+  m_staTable.avgRate[aid] = std::max (m_staTable.avgRate[aid] - credit, 0.0);
+  m_staTable.lastCredit[aid] = 0;
+}
 
+double
+RrOfdmaManager::GetAverageRate (uint16_t aid) const
+{
+  return m_staTable.avgRate[aid] * std::exp (-(Simulator::Now () - m_staTable.lastServed[aid]).GetSeconds ()
+                                             / m_avgRateTau.GetSeconds ());
+}
 
+double
+RrOfdmaManager::GetInstantaneousRate (uint16_t aid, const WifiTxVector& suTxVector) const
+{
+  HeRu::RuType ruType = GetChannelRuType (m_low->GetPhy ()->GetChannelWidth ());
+  uint8_t mcs = GetMuMcs (aid, ruType, suTxVector.GetMode ().GetMcsValue ());
+  return GetHeRuDataRate (ruType, mcs, suTxVector.GetNss (),
+                          m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ());
+}
 
+void
+RrOfdmaManager::StationTable::Resize (std::size_t size)
+{
+  address.resize (size);
+  tid.resize (size);
+  qosType.resize (size);
+  backlog.resize (size);
+  holSize.resize (size);
+  holDelay.resize (size);
+  weight.resize (size);
+  mcs.resize (size);
+  nss.resize (size);
+  instRate.resize (size);
+  avgRate.resize (size);
+  lastServed.resize (size);
+  lastCredit.resize (size);
+  snr.resize (size);
+  rxWidth.resize (size);
+  lastRx.resize (size);
+  backlogTids.resize (size);
+  queuedPackets.resize (size);
+  queuedBytes.resize (size);
+  suTxVector.resize (size);
+  suTxVectorTime.resize (size, Time::Min ());
+  ulBuffer.resize (size);
+  lastBsr.resize (size, Time::Min ());
+}
 
+void
+RrOfdmaManager::StationTable::Reset (uint16_t aid, Mac48Address addr)
+{
+  address[aid] = addr;
+  tid[aid] = 0;
+  qosType[aid] = 0;
+  backlog[aid] = 0;
+  holSize[aid] = 0;
+  holDelay[aid] = 0;
+  weight[aid] = 0;
+  mcs[aid] = 0;
+  nss[aid] = 1;
+  instRate[aid] = 0;
+  avgRate[aid] = 0;
+  lastServed[aid] = Simulator::Now ();
+  lastCredit[aid] = 0;
+  snr[aid] = 0;
+  rxWidth[aid] = 0;
+  lastRx[aid] = Simulator::Now ();
+  backlogTids[aid] = 0;
+  queuedPackets[aid].fill (0);
+  queuedBytes[aid].fill (0);
+  suTxVectorTime[aid] = Time::Min ();
+  ulBuffer[aid] = 0;
+  lastBsr[aid] = Time::Min ();
+}
 
+void
+RrOfdmaManager::UpdateStationTable (const std::map<uint16_t, Mac48Address>& staList)
+{
+  if (staList.empty ())
+    {
+      return;
+    }
 
+  // AIDs are sorted in the list of associated stations
+  std::size_t size = staList.rbegin ()->first + 1;
+  if (size > m_staTable.address.size ())
+    {
+      m_staTable.Resize (size);
+    }
 
+  for (auto& sta : staList)
+    {
+      if (m_staTable.address[sta.first] != sta.second)
+        {
+          // the AID has been assigned to a new station
+          auto it = m_staAid.find (m_staTable.address[sta.first]);
+          if (it != m_staAid.end () && it->second == sta.first)
+            {
+              m_staAid.erase (it);
+            }
+          NS_LOG_DEBUG ("Adding STA (MAC=" << sta.second << ", AID=" << sta.first << ") to the station table");
+          m_backlogged.erase (sta.first);
+          m_staTable.Reset (sta.first, sta.second);
+          m_staAid[sta.second] = sta.first;
+          InitBacklog (sta.first);
+        }
+    }
+}
 
+void
+RrOfdmaManager::InitBacklog (uint16_t aid)
+{
+  NS_LOG_FUNCTION (this << aid);
 
+  Mac48Address address = m_staTable.address[aid];
+  for (uint8_t tid = 0; tid < 8; tid++)
+    {
+      Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (tid)];
+      SetQueuedPackets (aid, tid, txop->GetWifiMacQueue ()->GetNPacketsByTidAndAddress (tid, address)
+                                  + txop->GetBaManager ()->GetRetransmitQueue ()->GetNPacketsByTidAndAddress (tid, address));
+    }
+}
 
+void
+RrOfdmaManager::SetQueuedPackets (uint16_t aid, uint8_t tid, uint32_t nPackets)
+{
+  m_staTable.queuedPackets[aid][tid] = nPackets;
+  if (nPackets > 0)
+    {
+      m_staTable.backlogTids[aid] |= (1 << tid);
+      m_backlogged.insert (aid);
+    }
+  else
+    {
+      m_staTable.backlogTids[aid] &= ~(1 << tid);
+      if (m_staTable.backlogTids[aid] == 0)
+        {
+          m_backlogged.erase (aid);
+        }
+    }
+}
 
+void
+RrOfdmaManager::NotifyEnqueue (Ptr<const WifiMacQueueItem> item)
+{
+  const WifiMacHeader& hdr = item->GetHeader ();
+  if (!hdr.IsQosData () || hdr.GetAddr1 ().IsGroup ())
+    {
+      return;
+    }
 
-void RrOfdmaManager::Largest_Weighted_First(){
+  uint16_t aid = GetAid (hdr.GetAddr1 ());
+  if (aid == 0)
+    {
+      // the receiver may have just associated. If so, it is added to the station
+      // table and its backlog, including this frame, is read from the queues
+      UpdateStationTable (m_apMac->GetStaList ());
+      aid = GetAid (hdr.GetAddr1 ());
+      if (aid != 0)
+        {
+          m_staTable.queuedBytes[aid][hdr.GetQosTid ()] += item->GetPacket ()->GetSize ();
+        }
+      return;
+    }
 
+  uint8_t tid = hdr.GetQosTid ();
+  SetQueuedPackets (aid, tid, m_staTable.queuedPackets[aid][tid] + 1);
+  m_staTable.queuedBytes[aid][tid] += item->GetPacket ()->GetSize ();
+}
 
-int lower=1,upper=11;
-int count=v_dataStaPair.size();
+void
+RrOfdmaManager::NotifyDequeue (Ptr<const WifiMacQueueItem> item)
+{
+  // this is also notified when frames are removed from the queue (e.g., because
+  // they expired)
+  const WifiMacHeader& hdr = item->GetHeader ();
+  if (!hdr.IsQosData () || hdr.GetAddr1 ().IsGroup ())
+    {
+      return;
+    }
 
-  random_MCS.clear();
-for(int i=0;i<count;i++){
-  int num= (rand()%(upper-lower+1))+lower;
-  random_MCS.push_back(num);
+  uint16_t aid = GetAid (hdr.GetAddr1 ());
+  uint8_t tid = hdr.GetQosTid ();
+  if (aid != 0 && m_staTable.queuedPackets[aid][tid] > 0)
+    {
+      SetQueuedPackets (aid, tid, m_staTable.queuedPackets[aid][tid] - 1);
+      uint32_t& bytes = m_staTable.queuedBytes[aid][tid];
+      bytes = (m_staTable.queuedPackets[aid][tid] == 0 ? 0 : bytes - std::min (bytes, item->GetPacket ()->GetSize ()));
+    }
+}
 
+uint16_t
+RrOfdmaManager::GetAid (Mac48Address address) const
+{
+  auto it = m_staAid.find (address);
+  return (it == m_staAid.end () ? 0 : it->second);
 }
 
+std::size_t
+RrOfdmaManager::GetMaxNRus (uint16_t bandwidth)
+{
+  if (bandwidth == 160)
+    {
+      return 2 * HeRu::m_heRuSubcarrierGroups.at ({80, HeRu::RU_26_TONE}).size ();
+    }
+  if (bandwidth == 20 || bandwidth == 40 || bandwidth == 80)
+    {
+      return HeRu::m_heRuSubcarrierGroups.at ({bandwidth, HeRu::RU_26_TONE}).size ();
+    }
+  return 0;
+}
 
-  std::cout<<"inside Largest_Weighted_First before clearing vectors";
-// check for bandwidth if different bandwidh and genealization of Ru allocation used
-// auto a=dataStaPair.begin();
-// auto b=powerLevel.begin();
-// auto c=QosType.begin();
-//auto d=dataStaPair1.begin();
-//auto e=finalStaPairIndex.begin();
-//a++;
-int countt=0;
+HeRu::RuType
+RrOfdmaManager::GetChannelRuType (uint16_t bandwidth)
+{
+  switch (bandwidth)
+    {
+    case 20:
+      return HeRu::RU_242_TONE;
+    case 40:
+      return HeRu::RU_484_TONE;
+    case 80:
+      return HeRu::RU_996_TONE;
+    case 160:
+      return HeRu::RU_2x996_TONE;
+    default:
+      NS_FATAL_ERROR ("Unsupported channel width: " << bandwidth << " MHz");
+    }
+  return HeRu::RU_26_TONE;
+}
 
+std::vector<std::set<RrOfdmaManager::RuTiling>>
+RrOfdmaManager::GetSubTilings (HeRu::RuType ruType)
+{
+  std::vector<std::set<RuTiling>> tilings (2);
+  tilings[1].insert ({ruType});
 
- std::cout<<"inside Largest_Weighted_First before calculating (loop)";
+  if (ruType == HeRu::RU_26_TONE)
+    {
+      return tilings;
+    }
 
-// while(a!=dataStaPair.end() || b!=powerLevel.end() || c!=QosType.end()){
-//   //get type of application and calucate what is the  Pr {W i > T i } £ d i
-  
-//   double a_i_i=calculate_a_i(c->first) ;   ////=log(delta)/Time
-//   double avg_chn_cap=averageChannelcapacity();
-//   //         ///maximize= (-log(detla)*Data*Transimmison power)/averagePower
-//   double final_cost=((a->first*a_i_i*b->first)/avg_chn_cap);
+  // An RU can be split into two RUs of the next smaller size. When splitting a
+  // 242-tone RU or a 996-tone RU, the 26-tone RU in the middle may be used or not
+  HeRu::RuType childType = static_cast<HeRu::RuType> (ruType - 1);
+  bool hasCenterRu = (ruType == HeRu::RU_242_TONE || ruType == HeRu::RU_996_TONE);
+  std::vector<std::set<RuTiling>> childTilings = GetSubTilings (childType);
 
-//   std::cout<<"\n Before dataStaPair1";
-//  dataStaPair1.push_back(std::make_pair(final_cost,a->second));
-//  std::cout<<"\n Before finalStaPairIndex-----datastapair alur"<<final_cost;
-//    //finalStaPairIndex.push_back(std::make_pair(final_cost,countt));
-//   //std::cout<<" \n \n Inside dataStaPair1 First"<<d->first<<"  TID  "<<d->second;
-//   //std::cout<<" \n \n (While )Inside Final Sta Pair First----"<<finalStaPairIndex[countt].first<<"  TID  "<<finalStaPairIndex[countt].second;
+  for (std::size_t n1 = 1; n1 < childTilings.size (); n1++)
+    {
+      for (std::size_t n2 = n1; n2 < childTilings.size (); n2++)
+        {
+          std::size_t maxN = n1 + n2 + (hasCenterRu ? 1 : 0);
+          if (tilings.size () <= maxN)
+            {
+              tilings.resize (maxN + 1);
+            }
+          for (auto& t1 : childTilings[n1])
+            {
+              for (auto& t2 : childTilings[n2])
+                {
+                  RuTiling tiling (t1);
+                  tiling.insert (tiling.end (), t2.begin (), t2.end ());
+                  std::sort (tiling.begin (), tiling.end (), std::greater<HeRu::RuType> ());
+                  tilings[n1 + n2].insert (tiling);
+                  if (hasCenterRu)
+                    {
+                      tiling.push_back (HeRu::RU_26_TONE);
+                      tilings[n1 + n2 + 1].insert (tiling);
+                    }
+                }
+            }
+        }
+    }
+  return tilings;
+}
 
-// std::cout<<"\n a++";
-// a++;
-// std::cout<<"\n B++";
-// b++;
-// std::cout<<"\n c++";
-// c++;
-// //d++;
+const std::vector<RrOfdmaManager::RuTiling>&
+RrOfdmaManager::GetRuTilings (uint16_t bandwidth, std::size_t nRus)
+{
+  NS_LOG_FUNCTION (this << bandwidth << nRus);
 
+  auto it = m_ruTilings.find ({bandwidth, nRus});
+  if (it != m_ruTilings.end ())
+    {
+      return it->second;
+    }
 
+  std::vector<RuTiling>& tilings = m_ruTilings[{bandwidth, nRus}];
 
-// }
-//double avg_chn_cap=averageChannelcapacity();
+  if (nRus == 0 || nRus > GetMaxNRus (bandwidth))
+    {
+      return tilings;
+    }
 
-//int j=0,k=0;
-for(unsigned int i = 0; i<v_dataStaPair.size();i++){
-  //get type of application and calucate what is the  Pr {W i > T i } £ d i
-  
-  double a_i_i=calculate_a_i(v_QosType[i]) ;   ////=log(delta)/Time
-  
+  if (bandwidth == 160)
+    {
+      if (nRus == 1)
+        {
+          tilings.push_back ({HeRu::RU_2x996_TONE});
+          return tilings;
+        }
+      // each 80 MHz segment is tiled independently. Tilings for 160 MHz are
+      // computed for the requested number of RUs only, as they are many more
+      std::set<RuTiling> tilingSet;
+      for (std::size_t n1 = 1; n1 <= nRus / 2; n1++)
+        {
+          for (auto& t1 : GetRuTilings (80, n1))
+            {
+              for (auto& t2 : GetRuTilings (80, nRus - n1))
+                {
+                  RuTiling tiling (t1);
+                  tiling.insert (tiling.end (), t2.begin (), t2.end ());
+                  std::sort (tiling.begin (), tiling.end (), std::greater<HeRu::RuType> ());
+                  tilingSet.insert (tiling);
+                }
+            }
+        }
+      tilings.assign (tilingSet.begin (), tilingSet.end ());
+      return tilings;
+    }
 
-//   std::cout<<"\n\n\n Average Channel Capacity---------------------"<<avg_chn_cap;
+  // compute and cache the tilings for all the possible number of RUs at once
+  std::vector<std::set<RuTiling>> subTilings = GetSubTilings (GetChannelRuType (bandwidth));
 
+  for (std::size_t n = 1; n < subTilings.size (); n++)
+    {
+      m_ruTilings[{bandwidth, n}].assign (subTilings[n].begin (), subTilings[n].end ());
+    }
+  return tilings;
+}
 
-//   std::cout<<"\n\n\n Probbilty Model ---------------------"<<a_i_i;
+RrOfdmaManager::RuTiling
+RrOfdmaManager::RuAlloc (uint16_t bandwidth, std::size_t nStations)
+{
+  NS_LOG_FUNCTION (this << bandwidth << nStations);
 
-//   std::cout<<"\n\n\n Power of Ith stations---------------------"<<v_powerLevel[i];
+  nStations = std::min (nStations, GetMaxNRus (bandwidth));
+  const std::vector<RuTiling>& candidates = GetRuTilings (bandwidth, nStations);
 
-//   std::cout<<"\n\n\n Data of Ith stations ---------------------"<<v_dataStaPair[i];
-//   //         ///maximize= (-log(detla)*Data*Transimmison power)/averagePower
+  if (candidates.empty ())
+    {
+      NS_LOG_DEBUG ("No RU tiling available for " << nStations << " stations in "
+                    << bandwidth << " MHz");
+      return RuTiling ();
+    }
 
+  // tilings are sorted by decreasing RU size. Select the tiling whose smallest RUs
+  // are the largest ones, i.e., compare tilings starting from their last element
+  auto best = candidates.begin ();
+  for (auto it = std::next (candidates.begin ()); it != candidates.end (); it++)
+    {
+      if (std::lexicographical_compare (best->rbegin (), best->rend (), it->rbegin (), it->rend ()))
+        {
+          best = it;
+        }
+    }
+  return *best;
+}
 
-//   if(avg_chn_cap==0){
-//     std::cout<<"\n inside avg_chn_cap==0";
-//     if(v_powerLevel[i]==0){
-//       std::cout<<"\n inside avg_chn_cap==0  && powerLevel==0";
+uint16_t
+RrOfdmaManager::GetNTones (HeRu::RuType ruType)
+{
+  switch (ruType)
+    {
+    case HeRu::RU_26_TONE:
+      return 26;
+    case HeRu::RU_52_TONE:
+      return 52;
+    case HeRu::RU_106_TONE:
+      return 106;
+    case HeRu::RU_242_TONE:
+      return 242;
+    case HeRu::RU_484_TONE:
+      return 484;
+    case HeRu::RU_996_TONE:
+      return 996;
+    case HeRu::RU_2x996_TONE:
+      return 2 * 996;
+    default:
+      NS_FATAL_ERROR ("Unknown RU type");
+    }
+  return 0;
+}
 
-//       final_cost=((v_dataStaPair[i]*a_i_i*5.0)/2.0);
-//       std::cout<<"fianl cost"<<final_cost; 
-//     }
-//  //final_cost=((v_dataStaPair[i]*a_i_i*v_powerLevel[i])/2.0);
-// }
+std::vector<HeRu::RuType>
+RrOfdmaManager::SelectRuTiling (uint16_t bandwidth, const std::vector<double>& demands)
+{
+  NS_LOG_FUNCTION (this << bandwidth << demands.size ());
+  NS_ASSERT (demands.size () <= GetMaxNRus (bandwidth));
 
+  std::vector<HeRu::RuType> ruTypes (demands.size ());
+  if (demands.empty ())
+    {
+      return ruTypes;
+    }
 
-// else{
-//   std::cout<<"\n else inside avg_chn_cap not 0";
+  // sort stations by decreasing demand
+  std::vector<std::size_t> order (demands.size ());
+  for (std::size_t i = 0; i < order.size (); i++)
+    {
+      order[i] = i;
+    }
+  std::stable_sort (order.begin (), order.end (),
+                    [&demands] (std::size_t a, std::size_t b) { return demands[a] > demands[b]; });
 
-//     if(v_powerLevel[i]==0){
-//        std::cout<<"\n inside avg_chn_cap==0  && powerLevel==0";
+  double totalDemand = 0;
+  for (auto& demand : demands)
+    {
+      totalDemand += demand;
+    }
 
-//       final_cost=((v_dataStaPair[i]*a_i_i*5)/avg_chn_cap);
-//       std::cout<<"fianl cost"<<final_cost; 
-//     }
-     
-//   final_cost=((v_dataStaPair[i]*a_i_i*v_powerLevel[i])/avg_chn_cap);
+  if (totalDemand <= 0)
+    {
+      RuTiling tiling = RuAlloc (bandwidth, demands.size ());
+      for (std::size_t j = 0; j < tiling.size (); j++)
+        {
+          ruTypes[order[j]] = tiling[j];
+        }
+      return ruTypes;
+    }
 
+  const RuTiling* best = nullptr;
+  double bestCost = 0;
+  uint32_t bestTones = 0;
 
-  
-//}
-  final_cost=((v_dataStaPair[i]*a_i_i*5.0)/2.0);
-  std::cout<<"\n\n\n Final Cost---------------------"<<final_cost;
+  for (auto& tiling : GetRuTilings (bandwidth, demands.size ()))
+    {
+      uint32_t totalTones = 0;
+      for (auto& ruType : tiling)
+        {
+          totalTones += GetNTones (ruType);
+        }
 
+      // both tilings and stations are sorted in decreasing order, hence the j-th
+      // largest RU is matched to the station with the j-th largest demand
+      double cost = 0;
+      for (std::size_t j = 0; j < tiling.size (); j++)
+        {
+          cost += std::abs (static_cast<double> (GetNTones (tiling[j])) / totalTones
+                            - demands[order[j]] / totalDemand);
+        }
 
-  std::cout<<"\n Before dataStaPair1 inserting";
- dataStaPair1.push_back(std::make_pair(final_cost,2));
- //std::cout<<"\n Before finalStaPairIndex-----datastapair alur"<<final_cost;
-   //finalStaPairIndex.push_back(std::make_pair(final_cost,countt));
-  //std::cout<<" \n \n Inside dataStaPair1 First"<<d->first<<"  TID  "<<d->second;
-  //std::cout<<" \n \n (While )Inside Final Sta Pair First----"<<finalStaPairIndex[countt].first<<"  TID  "<<finalStaPairIndex[countt].second;
+      // among equally good tilings, prefer those leaving no center RU unused
+      if (best == nullptr || cost < bestCost || (cost == bestCost && totalTones > bestTones))
+        {
+          best = &tiling;
+          bestCost = cost;
+          bestTones = totalTones;
+        }
+    }
 
-// std::cout<<"\n a++";
-// j++;
-// std::cout<<"\n B++";
-// k++;
-// std::cout<<"\n c++";
-// c++;
-//d++;
+  NS_ASSERT (best != nullptr);
+  for (std::size_t j = 0; j < best->size (); j++)
+    {
+      ruTypes[order[j]] = (*best)[j];
+    }
+  return ruTypes;
 }
 
+void
+RrOfdmaManager::NotifyMonitorSnifferRx (Ptr<const Packet> packet, uint16_t /*channelFreqMhz*/,
+                                        WifiTxVector txVector, MpduInfo /*aMpdu*/, SignalNoiseDbm signalNoise)
+{
+  WifiMacHeader hdr;
+  packet->PeekHeader (hdr);
 
+  // only frames addressed to the AP that carry the transmitter address (e.g., data
+  // frames in HE TB PPDUs and Block Acks) are considered
+  if ((!hdr.IsData () && !hdr.IsBlockAck ()) || hdr.GetAddr1 () != m_low->GetAddress ())
+    {
+      return;
+    }
 
+  uint16_t aid = GetAid (hdr.GetAddr2 ());
+  if (aid == 0)
+    {
+      return;
+    }
 
+  m_staTable.snr[aid] = signalNoise.signal - signalNoise.noise;
+  m_staTable.rxWidth[aid] = txVector.GetChannelWidth ();
+  m_staTable.lastRx[aid] = Simulator::Now ();
+  if (hdr.IsQosData ())
+    {
+      // QoS Data and QoS Null frames report the buffer status of the station
+      m_staTable.lastBsr[aid] = Simulator::Now ();
+    }
+  NS_LOG_DEBUG ("SNR of the link with " << hdr.GetAddr2 () << ": " << m_staTable.snr[aid] << " dB over "
+                << m_staTable.rxWidth[aid] << " MHz");
+}
 
+uint8_t
+RrOfdmaManager::GetMuMcs (uint16_t aid, HeRu::RuType ruType, uint8_t suMcs) const
+{
+  // minimum SNR (dB) required by each HE MCS
+  static const double minSnr[] = {2, 5, 9, 11, 15, 18, 20, 25, 29, 31, 34, 37};
 
+  // 1024-QAM (MCS 10 and 11) can only be used on RUs of at least 242 tones
+  uint8_t maxMcs = (ruType >= HeRu::RU_242_TONE ? 11 : 9);
 
+  if (m_staTable.rxWidth[aid] == 0 || Simulator::Now () - m_staTable.lastRx[aid] > m_linkQualityTimeout)
+    {
+      return std::min (suMcs, maxMcs);
+    }
 
+  // The AP spreads its power evenly over the whole channel, hence the SNR per tone
+  // (and thus the SNR on any RU) is the measured SNR scaled by the ratio between
+  // the width of the received PPDU and the channel width
+  uint16_t channelWidth = m_low->GetPhy ()->GetChannelWidth ();
+  double snr = m_staTable.snr[aid] + 10 * std::log10 (static_cast<double> (m_staTable.rxWidth[aid]) / channelWidth);
 
+  uint8_t mcs = 0;
+  while (mcs < maxMcs && snr >= minSnr[mcs + 1])
+    {
+      mcs++;
+    }
+  return mcs;
+}
 
+uint64_t
+RrOfdmaManager::GetHeRuDataRate (HeRu::RuType ruType, uint8_t mcs, uint8_t nss, uint16_t guardInterval)
+{
+  // number of data subcarriers per RU type
+  static const uint16_t nDataSubcarriers[] = {24, 48, 102, 234, 468, 980, 1960};
+  // coded bits per subcarrier times coding rate for each HE MCS
+  static const double bitsPerSubcarrier[] = {0.5, 1.0, 1.5, 2.0, 3.0, 4.0, 4.5, 5.0, 6.0, 20.0 / 3, 7.5, 25.0 / 3};
+
+  NS_ASSERT (mcs <= 11);
+  double symbolDuration = 12.8e-6 + guardInterval * 1e-9;
+  return static_cast<uint64_t> (nDataSubcarriers[ruType] * bitsPerSubcarrier[mcs] * nss / symbolDuration);
+}
 
+std::vector<std::size_t>
+RrOfdmaManager::SolveAssignment (const std::vector<std::vector<double>>& value)
+{
+  // Hungarian algorithm (Kuhn-Munkres with potentials) minimizing the opposite of
+  // the value. Rows and columns are 1-based in the loops below
+  std::size_t n = value.size ();
+  const double inf = std::numeric_limits<double>::infinity ();
+  std::vector<double> u (n + 1, 0), v (n + 1, 0);
+  std::vector<std::size_t> p (n + 1, 0), way (n + 1, 0);
+
+  for (std::size_t i = 1; i <= n; i++)
+    {
+      p[0] = i;
+      std::size_t j0 = 0;
+      std::vector<double> minv (n + 1, inf);
+      std::vector<bool> used (n + 1, false);
+      do
+        {
+          used[j0] = true;
+          std::size_t i0 = p[j0], j1 = 0;
+          double delta = inf;
+          for (std::size_t j = 1; j <= n; j++)
+            {
+              if (!used[j])
+                {
+                  double cur = -value[i0 - 1][j - 1] - u[i0] - v[j];
+                  if (cur < minv[j])
+                    {
+                      minv[j] = cur;
+                      way[j] = j0;
+                    }
+                  if (minv[j] < delta)
+                    {
+                      delta = minv[j];
+                      j1 = j;
+                    }
+                }
+            }
+          for (std::size_t j = 0; j <= n; j++)
+            {
+              if (used[j])
+                {
+                  u[p[j]] += delta;
+                  v[j] -= delta;
+                }
+              else
+                {
+                  minv[j] -= delta;
+                }
+            }
+          j0 = j1;
+        } while (p[j0] != 0);
+      do
+        {
+          std::size_t j1 = way[j0];
+          p[j0] = p[j1];
+          j0 = j1;
+        } while (j0 != 0);
+    }
 
+  std::vector<std::size_t> assignment (n);
+  for (std::size_t j = 1; j <= n; j++)
+    {
+      assignment[p[j] - 1] = j - 1;
+    }
+  return assignment;
+}
 
+std::vector<std::size_t>
+RrOfdmaManager::AssignRus (const std::vector<HeRu::RuType>& rus, const std::vector<RuCandidate>& candidates,
+                           Time duration) const
+{
+  NS_LOG_FUNCTION (this << rus.size () << candidates.size () << duration);
+  NS_ASSERT (rus.size () == candidates.size ());
 
-std::cout<<"\n After While Loop in LWDF";
-//auto x=dataStaPair1.begin();
-std::cout<<"\n Before dataStaPair1 Loop fofr finalStaPairIndex";
-int zz = dataStaPair1.size();
-std::cout<<"\n"<<zz;
-int i=0;
+  uint16_t gi = m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ();
 
-for(int x=0;x<zz;x++){
+  // value[i][j] is the weighted number of bytes that station i can receive in RU j
+  std::vector<std::vector<double>> value (candidates.size (), std::vector<double> (rus.size ()));
+  for (std::size_t i = 0; i < candidates.size (); i++)
+    {
+      for (std::size_t j = 0; j < rus.size (); j++)
+        {
+          uint8_t mcs = GetMuMcs (candidates[i].aid, rus[j], candidates[i].mcs);
+          double bytes = GetHeRuDataRate (rus[j], mcs, candidates[i].nss, gi) * duration.GetSeconds () / 8;
+          value[i][j] = candidates[i].weight * std::min (bytes, static_cast<double> (candidates[i].backlog));
+        }
+    }
 
-  std::cout<<"\n  \n dataStaPair1 data ------"<<dataStaPair1[x].first<<"------ Second"<<dataStaPair1[x].second;
+  return SolveAssignment (value);
 }
 
-finalStaPairIndex.clear();
-for(int x=0;x<zz;x++)
+uint64_t
+RrOfdmaManager::GetRuMask (uint16_t bandwidth, HeRu::RuType ruType, std::size_t index)
 {
-  std::cout<<"\n Inside single finalStaPairIndex";
+  NS_ASSERT (bandwidth == 20 || bandwidth == 40 || bandwidth == 80);
+  NS_ASSERT (index >= 1 && index <= HeRu::m_heRuSubcarrierGroups.at ({bandwidth, ruType}).size ());
 
-  std::cout<<"\n  \n data to be inserted finalStaPairIndexnal------"<<dataStaPair1[x].first<<"count------value"<<countt;
-  finalStaPairIndex.push_back(std::make_pair(dataStaPair1[x].first,countt));
-  //zz--;
-  i++;
-  countt++;
-}
+  // 26-tone RUs are numbered consecutively, including the center 26-tone RU of
+  // an 80 MHz channel (the 19th one)
+  std::size_t first = index - 1;
+  std::size_t nUnits = 1;
 
-// for(int x=0;x<zz;x++){
+  switch (ruType)
+    {
+    case HeRu::RU_26_TONE:
+      break;
+    case HeRu::RU_52_TONE:
+    case HeRu::RU_106_TONE:
+    case HeRu::RU_242_TONE:
+      {
+        // position of the RUs within a 20 MHz channel (in units of 26-tone RUs)
+        static const std::vector<std::size_t> offsets52 {0, 2, 5, 7};
+        static const std::vector<std::size_t> offsets106 {0, 5};
+        static const std::vector<std::size_t> offsets242 {0};
+        const std::vector<std::size_t>& offsets = (ruType == HeRu::RU_52_TONE ? offsets52
+                                                   : (ruType == HeRu::RU_106_TONE ? offsets106 : offsets242));
+        std::size_t subchannel = (index - 1) / offsets.size ();
+        // in an 80 MHz channel, the upper 40 MHz follow the center 26-tone RU
+        first = subchannel * 9 + (subchannel >= 2 ? 1 : 0) + offsets[(index - 1) % offsets.size ()];
+        nUnits = (ruType == HeRu::RU_52_TONE ? 2 : (ruType == HeRu::RU_106_TONE ? 4 : 9));
+        break;
+      }
+    case HeRu::RU_484_TONE:
+      first = (index - 1) * 19;
+      nUnits = 18;
+      break;
+    case HeRu::RU_996_TONE:
+      first = 0;
+      nUnits = 37;
+      break;
+    default:
+      NS_FATAL_ERROR ("RU type " << ruType << " does not fit an 80 MHz segment");
+    }
 
-//   std::cout<<"\n  \n finalStaPairIndex data  ------"<<finalStaPairIndex[x].first<<"------ index-------"<<finalStaPairIndex[x].second;
-// }
+  return ((uint64_t (1) << nUnits) - 1) << first;
+}
 
+Time
+RrOfdmaManager::GetDlMuResponseDuration (const std::map<Mac48Address, DlPerStaInfo>& staList,
+                                         HeRu::RuType ruType, DlMuAckSequenceType ackSequence)
+{
+  NS_LOG_FUNCTION (this << staList.size () << ruType << +ackSequence);
 
-//void insertionSort(int arr[], int n)  
-//{  
-//{  
-std::cout<<"\n \n Before Sorting";
-int n=finalStaPairIndex.size();
-std::cout<<"\n finalStaPairIndex Size"<<n;
-    int counter, key, counter1;  
-    for (counter = 1; counter < n; counter++) 
-    {  
-        key = finalStaPairIndex[counter].first;  
-        counter1 = counter - 1;  
-        std::cout<<"\n \n inside insertion sort";
-        /* Move elements of arr[0..i-s1], that are  
-        greater than key, to one position ahead  
-        of their current position */
-        while (counter1 >= 0 && finalStaPairIndex[counter1].first < key) 
-        {  
-            finalStaPairIndex[counter1+1].first = finalStaPairIndex[counter].first;  
-            counter1 = counter1 - 1;  
-        }  
-        finalStaPairIndex[counter+1].first = key;  
-    }  
+  // The response time only depends on the ack sequence and on the RU, MCS, NSS
+  // and BlockAck agreement of the users, hence it is cached. The TX vector and
+  // TX params are only built if the response time is not in the cache
+  Ptr<WifiMacQueueItem> item = Copy (m_mpdu);
+  std::vector<uint64_t> users;
+  for (auto& sta : staList)
+    {
+      item->GetHeader ().SetAddr1 (sta.first);
+      WifiTxVector suTxVector = GetSuTxVector (sta.second.aid, item);
+      BlockAckReqType barType;
+      BlockAckType baType;
+      GetBlockAckTypes (sta.first, sta.second.tid, barType, baType);
+      // stations selected by Largest_Weighted_First may be assigned RUs of different size
+      auto ruTypeIt = mappedRuAllocated.find (sta.second.aid);
+      users.push_back (PackAirtimeUser (ruTypeIt != mappedRuAllocated.end () ? ruTypeIt->second : ruType,
+                                        suTxVector.GetMode ().GetMcsValue (), suTxVector.GetNss (),
+                                        PackAirtimeAck (barType, baType)));
+    }
+  AirtimeKey key = GetAirtimeKey (DL_RESPONSE, ackSequence, users);
+  int64_t cached;
 
+  if (FindAirtime (key, cached))
+    {
+      return TimeStep (cached);
+    }
 
-std::cout<<"\n \n After  Sorting";
+  InitTxVectorAndParams (staList, ruType, ackSequence);
 
-int xyz=finalStaPairIndex.size();
-for(int x=0;x<xyz;x++){
+  // TODO Account for MU-RTS/CTS when implemented
+  CtrlTriggerHeader trigger;
 
-  std::cout<<"\n  \n finalStaPairIndex data  ------"<<finalStaPairIndex[x].first<<"------ index-------"<<finalStaPairIndex[x].second;
+  if (ackSequence == DlMuAckSequenceType::DL_MU_BAR
+      || ackSequence == DlMuAckSequenceType::DL_AGGREGATE_TF)
+    {
+      // Need to prepare the MU-BAR to correctly get the response time
+      trigger = GetTriggerFrameHeader (m_txVector, 5);
+      trigger.SetUlLength (GetUlLengthForBlockAcks (trigger, m_txVector, staList));
+    }
+  Time response = GetResponseDuration (m_txParams, m_txVector, trigger);
+  StoreAirtime (key, response.GetTimeStep ());
+  return response;
 }
 
+Time
+RrOfdmaManager::GetDlMuAckCost (const std::map<Mac48Address, DlPerStaInfo>& staList, HeRu::RuType ruType,
+                                DlMuAckSequenceType ackSequence, Time available)
+{
+  NS_LOG_FUNCTION (this << staList.size () << ruType << +ackSequence << available);
 
+  Time response = GetDlMuResponseDuration (staList, ruType, ackSequence);
 
-//sort(dataStaPair1.end(),dataStaPair1.begin());
+  std::vector<uint16_t> stations;
+  for (auto& sta : staList)
+    {
+      stations.push_back (sta.second.aid);
+    }
+  WifiTxVector txVector = GetEstimateTxVector (stations, ruType, true);
 
-//sort(finalStaPairIndex.end(),finalStaPairIndex.begin());
+  // with the aggregated MU-BAR sequence, every PSDU also carries the Trigger Frame,
+  // i.e., an A-MPDU subframe including the MAC header, the Trigger Frame, the FCS
+  // and the MPDU delimiter, padded to a multiple of 4 bytes
+  uint32_t tfSize = 0;
+  if (ackSequence == DlMuAckSequenceType::DL_AGGREGATE_TF)
+    {
+      WifiMacHeader hdr;
+      hdr.SetType (WIFI_MAC_CTL_TRIGGER);
+      tfSize = (hdr.GetSize () + GetTriggerFrameHeader (txVector, 5).GetSerializedSize () + 8 + 3) / 4 * 4;
+    }
 
+  // the DL MU PPDU lasts as long as the longest PSDU, hence the extension is the
+  // difference between the longest PSDUs with and without the Trigger Frames
+  uint16_t guardInterval = txVector.GetGuardInterval ();
+  Time minDuration = Seconds (0);
+  Time duration = Seconds (0);
+  Time extendedDuration = Seconds (0);
+  for (auto& userInfo : txVector.GetHeMuUserInfoMap ())
+    {
+      uint16_t aid = userInfo.first;
+      minDuration = Max (minDuration, GetMuPsduDuration (m_staTable.holSize[aid] + tfSize, txVector, aid));
+      Time txTime = Min (GetMuPsduDuration (m_staTable.backlog[aid], txVector, aid), m_maxDlDuration);
+      uint64_t rate = GetHeRuDataRate (userInfo.second.ru.ruType, userInfo.second.mcs.GetMcsValue (),
+                                       userInfo.second.nss, guardInterval);
+      duration = Max (duration, txTime);
+      extendedDuration = Max (extendedDuration, txTime + Seconds (tfSize * 8.0 / rate));
+    }
 
+  if (minDuration > GetPpduMaxTime (WIFI_PREAMBLE_HE_MU) || minDuration + response > available)
+    {
+      NS_LOG_DEBUG ("Ack sequence " << +ackSequence << " does not fit the available time");
+      return Time::Max ();
+    }
+  return extendedDuration - duration + response;
+}
 
-//
+std::size_t
+RrOfdmaManager::SelectNumberOfUsers (uint16_t bandwidth, const std::vector<uint16_t>& stations,
+                                     HeRu::RuType& ruType)
+{
+  NS_LOG_FUNCTION (this << bandwidth);
 
-//
+  uint16_t guardInterval = m_low->GetPhy ()->GetGuardInterval ().GetNanoSeconds ();
+  std::size_t bestN = 0;
+  double bestGoodput = -1;
 
-//
-// 20 Mhz channel , may geralized later
-//std::vector<int> finalRUAlloc;
+  // the first k stations are served by a DL MU PPDU including k users. The goodput is estimated as the bytes delivered to the
+  // users divided by the duration of the DL MU PPDU (including preamble, SIG-B,
+  // which grows with the number of users, and padding up to the longest PSDU)
+  // and of the response
+  for (std::size_t k = 1; k <= stations.size (); k++)
+    {
+      std::size_t nUsers = k;
+      HeRu::RuType type = GetNumberAndTypeOfRus (bandwidth, nUsers);
+      if (nUsers != k)
+        {
+          // the same RU type is assigned to fewer users, which has been evaluated
+          continue;
+        }
 
+      std::vector<uint16_t> users (stations.begin (), stations.begin () + nUsers);
+      WifiTxVector txVector = GetEstimateTxVector (users, type, false);
+      std::map<Mac48Address, DlPerStaInfo> staList;
+      for (auto& aid : users)
+        {
+          staList.insert ({m_staTable.address[aid], {aid, m_staTable.tid[aid]}});
+        }
 
+      Time duration = Seconds (0);
+      double bytes = 0;
+      for (auto& aid : users)
+        {
+          Time txTime = GetMuPsduDuration (m_staTable.backlog[aid], txVector, aid);
+          if (txTime > m_maxDlDuration)
+            {
+              // the user only receives the bytes that fit into the DL MU PPDU
+              txTime = m_maxDlDuration;
+              uint8_t mcs = txVector.GetHeMuUserInfoMap ().at (aid).mcs.GetMcsValue ();
+              bytes += GetHeRuDataRate (type, mcs, m_staTable.nss[aid], guardInterval)
+                       * m_maxDlDuration.GetSeconds () / 8;
+            }
+          else
+            {
+              bytes += m_staTable.backlog[aid];
+            }
+          duration = std::max (duration, txTime);
+        }
+      duration += GetDlMuResponseDuration (staList, type, m_dlMuAckSequence);
 
+      double goodput = bytes / (duration.GetSeconds () * 1e6);
+      NS_LOG_DEBUG (nUsers << " users on " << type << " RUs: " << bytes << " bytes in "
+                    << duration << " (" << goodput << " bytes/us)");
+      if (goodput > bestGoodput)
+        {
+          bestN = nUsers;
+          bestGoodput = goodput;
+          ruType = type;
+        }
+    }
+  return bestN;
+}
 
+void
+RrOfdmaManager::UpdateTxopState (Time txopRemaining)
+{
+  NS_LOG_FUNCTION (this << txopRemaining);
 
-int noOfSTA=finalStaPairIndex.size();
-int temp2=noOfSTA;
+  // the end of the TXOP does not change while the TXOP is ongoing
+  Time txopEnd = Simulator::Now () + txopRemaining;
+  if (txopEnd != m_txopEnd)
+    {
+      if (m_nSentPpdus > 0)
+        {
+          m_metrics->Record (RrOfdmaMetrics::DL_PPDUS_PER_TXOP, m_nSentPpdus);
+        }
+      m_txopEnd = txopEnd;
+      m_nSentPpdus = 0;
+      m_servedInTxop.clear ();
+    }
+}
 
-std::cout<<"\n \n Before RuAlloc Call ";
-RuAlloc(noOfSTA); 
-for(unsigned int j=0;j<finalRUAlloc.size();j++){
-  std::cout<<"\n--- finalRUAlloc   "<<finalRUAlloc[j];
+bool
+RrOfdmaManager::IsServedInTxop (uint16_t aid) const
+{
+  return m_txopUserRotation && Simulator::Now () < m_txopEnd && m_servedInTxop.count (aid) > 0;
 }
-mappedRuAllocated.clear();
-std::cout<<"\n \n Before Mapped RU LOOP Call ";
-for (int i=0; i<noOfSTA; i++){
- 
 
-switch(finalRUAlloc[i]){
-  case 26: mappedRuAllocated.push_back(HeRu::RU_26_TONE);
-           break;
-  case 52: mappedRuAllocated.push_back(HeRu::RU_52_TONE);
-           break;
-  case 106: mappedRuAllocated.push_back(HeRu::RU_106_TONE);
-           break;
-  case 242: mappedRuAllocated.push_back(HeRu::RU_242_TONE);
-           break;
-  case 484: mappedRuAllocated.push_back(HeRu::RU_484_TONE);
-           break;
-  }
-  std::cout<<"Mapping============================="<<mappedRuAllocated[i]<<"\n";
-}
-
-std::cout<<"\nmapping done\n";
-
-//bestRuConfigTempVar.clear();
-//bestAssignment.clear();
-
-
-
-
-//finalRUAlloc.clear();
-// finalRUAlloc=RuAlloc(noOfSTA);  /// Allocation Logic implemented in RUalloc // finalRuAlloc Example= {106,106,26}
-// std::cout<<"\n \n Before finalRUAlloc ";
-// mapped_He_RU(finalRUAlloc);
-
-
-//Sta Allocated//////////////
-// staAllocated.clear();
-// std::cout<<"\n \n Before STAPUSH BACK ";
-// auto startIt = m_staInfo.begin();
-//  for (int i=0; i<noOfSTA; i++){
-//             staAllocated.push_back (*startIt);
-//           startIt++;
-//         }
-       // std::cout<<"\n \n Before Sorting";
-
-//STA WIth Decreasing order.
-//std::cout<<"\n \n Before Sorting based Mac48Address and store in staAllocated1 value of temp=="<<temp2;
-// int count1=0;
-// staAllocated1.clear();
-// while(temp2){
-//   auto startItt = m_staInfo.begin();
-//       for(int i=0;i<noOfSTA;i++){
-//         if(finalStaPairIndex[i].second==count1){
-//           staAllocated1.push_back(*startItt);
-//           count1++;
-
-//         }
-//         startItt++;
-//         //break;
-//       }
-//       temp2--;
-
-// }
-
-std::cout<<"\n\n before staAllocated1 check how many m_staInfo there"<<m_staInfo.size();
-int temp3=0;
-staAllocated1.clear();
-while(temp2){
-  auto startItt = m_staInfo.begin();
- int dd = finalStaPairIndex[temp3].second;
-      for(int i=0;i<dd;i++){
-        // if(finalStaPairIndex[i].second==count1){
-        //   staAllocated1.push_back(*startItt);
-        //   count1++;
-
-        //}
-        startItt++;
-        //break;
-      }
-      staAllocated1.push_back(*startItt);
-      temp3++;
+std::size_t
+RrOfdmaManager::ScheduleUlUsers (const std::map<uint16_t, Mac48Address>& staList, uint16_t& nextStation)
+{
+  NS_LOG_FUNCTION (this << staList.size ());
 
-      temp2--;
+  uint16_t bw = m_low->GetPhy ()->GetChannelWidth ();
+  std::size_t maxUsers = std::min<std::size_t> (m_nStations, GetMaxNRus (bw));
+  m_txVector = GetMuTxVectorTemplate ();
+  m_ulTriggerType = TriggerFrameType::BASIC_TRIGGER;
+
+  // visit the associated stations in round robin order, starting from the UL
+  // cursor, and select those that reported a non-null (or no) buffer status
+  std::vector<uint16_t> users;
+  std::vector<double> demands;
+  auto staIt = staList.lower_bound (m_ulStartStation);
+  for (std::size_t nVisited = 0; nVisited < staList.size () && users.size () < maxUsers; nVisited++, staIt++)
+    {
+      if (staIt == staList.end ())
+        {
+          staIt = staList.begin ();
+        }
+      uint8_t queueSize = m_apMac->GetMaxBufferStatus (staIt->second);
+      uint32_t& buffer = m_staTable.ulBuffer[staIt->first];
+      if (queueSize == 0)
+        {
+          NS_LOG_DEBUG ("Station " << staIt->second << " has no frames to send");
+          continue;
+        }
+      else if (queueSize == 255)
+        {
+          NS_LOG_DEBUG ("Buffer status of station " << staIt->second << " is unknown");
+          buffer = m_ulPsduSize;
+        }
+      else if (queueSize == 254)
+        {
+          // the station has at least as many bytes as the largest queue size that
+          // can be reported. Sizing its RU and the HE TB PPDU based on this amount
+          // avoids that the other users pad a PPDU of the maximum duration
+          NS_LOG_DEBUG ("Buffer status of station " << staIt->second << " is not limited");
+          buffer = 254 * BUFFER_STATUS_UNIT;
+        }
+      else
+        {
+          NS_LOG_DEBUG ("Buffer status of station " << staIt->second << " is " << +queueSize);
+          buffer = queueSize * BUFFER_STATUS_UNIT;
+        }
+      users.push_back (staIt->first);
+      demands.push_back (buffer);
+    }
 
-}
+  if (users.empty ())
+    {
+      return 0;
+    }
+  // the first station to visit next time is the first one not visited this time
+  nextStation = (staIt == staList.end () ? staList.begin ()->first : staIt->first);
 
+  // RUs are sized in proportion to the buffered bytes, so that users with more
+  // bytes to send do not need a longer HE TB PPDU
+  SetUlUsers (users, SelectRuTiling (bw, demands));
+  return users.size ();
+}
 
-auto checking=staAllocated1.begin();
+std::size_t
+RrOfdmaManager::ScheduleBsrpUsers (const std::map<uint16_t, Mac48Address>& staList)
+{
+  NS_LOG_FUNCTION (this << staList.size ());
 
-  while(checking!=staAllocated1.end()){
-          std::cout<<"\n staAllocated1-- "<< checking->first;
-    checking++;
-  }
+  // stations whose buffer status has not been reported or solicited recently
+  Time now = Simulator::Now ();
+  std::vector<std::pair<Time, uint16_t>> stale;
+  for (auto& sta : staList)
+    {
+      const Time& lastBsr = m_staTable.lastBsr[sta.first];
+      if (lastBsr == Time::Min () || now - lastBsr > m_bufferStatusTimeout)
+        {
+          stale.push_back ({lastBsr, sta.first});
+        }
+    }
 
-std::cout<<"\n \n After Sorting based Mac48Address and store in staAllocated1"<<staAllocated1.size();
+  uint16_t bw = m_low->GetPhy ()->GetChannelWidth ();
+  std::size_t nUsers = std::min<std::size_t> (std::min<std::size_t> (m_bsrpGroupSize, GetMaxNRus (bw)),
+                                              stale.size ());
+  if (nUsers == 0)
+    {
+      return 0;
+    }
 
+  // the stations whose buffer status is the oldest are solicited first
+  std::partial_sort (stale.begin (), stale.begin () + nUsers, stale.end ());
+  std::vector<uint16_t> users;
+  for (std::size_t i = 0; i < nUsers; i++)
+    {
+      uint16_t aid = stale[i].second;
+      NS_LOG_DEBUG ("Soliciting the buffer status of station with AID=" << aid);
+      users.push_back (aid);
+      m_staTable.ulBuffer[aid] = QOS_NULL_SIZE;
+    }
 
+  m_ulTriggerType = TriggerFrameType::BSRP_TRIGGER;
+  SetUlUsers (users, RuAlloc (bw, nUsers));
+  return nUsers;
+}
 
-// selectiveMCS.clear();
+void
+RrOfdmaManager::SetUlUsers (const std::vector<uint16_t>& users, const std::vector<HeRu::RuType>& ruTypes)
+{
+  NS_LOG_FUNCTION (this << users.size ());
+  NS_ASSERT (ruTypes.size () == users.size ());
 
-// len=finalRUAlloc.size();
-// ;
-//   }
-// }
+  std::map<uint16_t, HeRu::RuType> userRuTypes;
+  for (std::size_t i = 0; i < users.size (); i++)
+    {
+      userRuTypes[users[i]] = ruTypes[i];
+    }
 
-  
+  // the MCS of every user is selected based on the quality of the link measured
+  // on the frames received from it
+  m_txVector = GetMuTxVectorTemplate ();
+  Ptr<WifiMacQueueItem> mpdu = Copy (m_mpdu);
+  for (auto& ru : PlaceRus (m_low->GetPhy ()->GetChannelWidth (), userRuTypes))
+    {
+      mpdu->GetHeader ().SetAddr1 (m_staTable.address[ru.first]);
+      WifiTxVector suTxVector = GetSuTxVector (ru.first, mpdu);
+      uint8_t mcs = GetMuMcs (ru.first, ru.second.ruType, suTxVector.GetMode ().GetMcsValue ());
+      NS_LOG_DEBUG ("UL user with AID=" << ru.first << " assigned " << ru.second << " and HE MCS " << +mcs);
+      m_txVector.SetHeMuUserInfo (ru.first, {ru.second, WifiPhy::GetHeMcs (mcs), suTxVector.GetNss ()});
+    }
 }
 
+std::map<uint16_t, HeRu::RuSpec>
+RrOfdmaManager::PlaceRus (uint16_t bandwidth, const std::map<uint16_t, HeRu::RuType>& ruTypes) const
+{
+  NS_LOG_FUNCTION (this << bandwidth << ruTypes.size ());
 
+  std::map<uint16_t, HeRu::RuSpec> ruSpecs;
 
+  // stations sorted by decreasing RU size. Placing larger RUs first in the first
+  // free position guarantees that a valid tiling is placed with no overlaps, as
+  // RUs of a given size are aligned to the boundaries of the next larger RUs and
+  // the center 26-tone RUs can only be taken by 26-tone RUs
+  std::vector<std::pair<HeRu::RuType, uint16_t>> stations;
+  for (auto& sta : ruTypes)
+    {
+      stations.push_back ({sta.second, sta.first});
+    }
+  std::stable_sort (stations.begin (), stations.end (),
+                    [] (const std::pair<HeRu::RuType, uint16_t>& a, const std::pair<HeRu::RuType, uint16_t>& b)
+                    { return a.first > b.first; });
+
+  uint16_t segmentWidth = std::min<uint16_t> (bandwidth, 80);
+  // occupied 26-tone RUs in the primary and (for 160 MHz) secondary 80 MHz segment
+  std::vector<uint64_t> occupied (bandwidth == 160 ? 2 : 1, 0);
+
+  for (auto& sta : stations)
+    {
+      if (sta.first == HeRu::RU_2x996_TONE)
+        {
+          NS_ASSERT (bandwidth == 160 && occupied[0] == 0 && occupied[1] == 0);
+          occupied[0] = occupied[1] = ~uint64_t (0);
+          ruSpecs[sta.second] = {true, HeRu::RU_2x996_TONE, 1};
+          continue;
+        }
 
+      std::size_t nRus = HeRu::m_heRuSubcarrierGroups.at ({segmentWidth, sta.first}).size ();
+      bool placed = false;
+
+      for (std::size_t segment = 0; segment < occupied.size () && !placed; segment++)
+        {
+          for (std::size_t index = 1; index <= nRus && !placed; index++)
+            {
+              uint64_t mask = GetRuMask (segmentWidth, sta.first, index);
+              if ((occupied[segment] & mask) == 0)
+                {
+                  occupied[segment] |= mask;
+                  ruSpecs[sta.second] = {segment == 0, sta.first, index};
+                  placed = true;
+                }
+            }
+        }
+      NS_ASSERT_MSG (placed, "Cannot place a " << sta.first << " RU for station " << sta.second);
+    }
 
+  return ruSpecs;
+}
 
+void
+RrOfdmaManager::Largest_Weighted_First (void)
+{
+  const DlSchedulingPolicy& policy = GetDlSchedulingPolicy (m_schedulingPolicy);
 
+  // compute the weight of every candidate station
+  for (uint16_t aid : m_candidates)
+    {
+      double a_i = calculate_a_i (m_staTable.qosType[aid]);
+
+      m_staTable.weight[aid] = policy.GetWeight ({a_i, m_staTable.holDelay[aid],
+                                                  m_staTable.instRate[aid], GetAverageRate (aid)});
+      // the weight is scaled by the fraction of the DL MU PPDU the station could fill
+      // with its queued bytes if it were assigned the whole channel, so that wide RUs
+      // are given to the stations that can fill them
+      double capacity = m_staTable.instRate[aid] * m_maxDlDuration.GetSeconds () / 8;
+      if (capacity > 0)
+        {
+          m_staTable.weight[aid] *= std::min (1.0, m_staTable.backlog[aid] / capacity);
+        }
+      NS_LOG_DEBUG ("Weight of STA with AID=" << aid << ": " << m_staTable.weight[aid]);
+    }
 
+  // keep the (at most) K stations with the highest weight, sorted by decreasing
+  // weight, where K is the minimum between NStations and the maximum number of RUs.
+  // Partial sorting costs O(n log K). Stations already served in the current TXOP
+  // come after all the others. Ties are broken in favor of the station that comes
+  // first in round robin order, i.e., in the list of candidates
+  uint16_t bw = m_low->GetPhy ()->GetChannelWidth ();
+  std::size_t nSelected = std::min ({m_candidates.size (), static_cast<std::size_t> (m_nStations),
+                                     GetMaxNRus (bw)});
+  std::vector<std::size_t> order (m_candidates.size ());
+  for (std::size_t i = 0; i < order.size (); i++)
+    {
+      order[i] = i;
+    }
+  std::partial_sort (order.begin (), order.begin () + nSelected, order.end (),
+                     [this] (std::size_t a, std::size_t b)
+                     {
+                       bool sa = IsServedInTxop (m_candidates[a]);
+                       bool sb = IsServedInTxop (m_candidates[b]);
+                       if (sa != sb)
+                         {
+                           return sb;
+                         }
+                       double wa = m_staTable.weight[m_candidates[a]];
+                       double wb = m_staTable.weight[m_candidates[b]];
+                       return wa > wb || (wa == wb && a < b);
+                     });
+  order.resize (nSelected);
+
+  if (m_adaptiveNStations)
+    {
+      // serve the number of highest-weight stations maximizing the estimated goodput
+      std::vector<uint16_t> stations;
+      for (std::size_t idx : order)
+        {
+          stations.push_back (m_candidates[idx]);
+        }
+      HeRu::RuType ruType;
+      order.resize (SelectNumberOfUsers (bw, stations, ruType));
+    }
 
+  // the demand of each station is given by its weight
+  std::vector<double> demands;
+  for (std::size_t idx : order)
+    {
+      demands.push_back (m_staTable.weight[m_candidates[idx]]);
+    }
+  std::vector<HeRu::RuType> ruTypes = SelectRuTiling (bw, demands);
 
+  // assign the RUs of the selected tiling to the stations so as to maximize the
+  // weighted sum of the bytes they can receive
+  std::vector<RuCandidate> candidates;
+  for (std::size_t idx : order)
+    {
+      uint16_t aid = m_candidates[idx];
+      candidates.push_back ({aid, m_staTable.weight[aid], m_staTable.backlog[aid],
+                             m_staTable.mcs[aid], m_staTable.nss[aid]});
+    }
+  std::vector<std::size_t> assignment = AssignRus (ruTypes, candidates, m_maxDlDuration);
+
+  mappedRuAllocated.clear ();
+  for (std::size_t j = 0; j < ruTypes.size (); j++)
+    {
+      mappedRuAllocated[candidates[j].aid] = ruTypes[assignment[j]];
+    }
+}
 
-////////////////////////////////////////////////COMPUTE DL OFDMA/////////////////////////////////////////////////////////
 OfdmaManager::DlOfdmaInfo
 RrOfdmaManager::ComputeDlOfdmaInfo (void)
 {
   NS_LOG_FUNCTION (this);
+  ScopedTimer timer (m_metrics, RrOfdmaMetrics::COMPUTE_DL_OFDMA_INFO_TIME);
 
-  if (m_staInfo.empty ())
+  if (m_candidates.empty ())
     {
+      NotifyDecision (OfdmaTxFormat::DL_OFDMA, false);
       return DlOfdmaInfo ();
     }
 
   uint16_t bw = m_low->GetPhy ()->GetChannelWidth ();
-//   uint16_t bw = m_bw;   // for TESTING only
 
   // compute how many stations can be granted an RU and the RU size
-  std::size_t nRusAssigned = m_staInfo.size ();
-std::cout<<"m_sta_info size: ComputeDlOfdmaInfo "<<m_staInfo.size ()<<"\n";
-  
-
-
-
-
-
-HeRu::RuType ruType ;
-
-if(v_dataStaPair.size()>1){
-  //call your function
-  
-Largest_Weighted_First();
-  std::cout<<"\n Largest_Weighted_First return\n";
-
-  nRusAssigned=finalRUAlloc.size();
-  std::cout<<"\nmin ru alloc size assigned to nru assigned"<<nRusAssigned<<"\n";
-
-  if(nRusAssigned==0) //in case no feasible ru allocation for current input exists.
-  {
-    std::cout<<"if(nRusAssigned==0) \n";
-    //std::size_t nRusAs = m_staInfo.size ();
-    nRusAssigned = m_staInfo.size ();
-    ruType = GetNumberAndTypeOfRus (bw, nRusAssigned);
-  }
-}else{
-  std::cout<<"inside else";
-  std::cout<<"if(dataStaPair.size()>1): false, in else case\n";
-  //std::size_t nRusAs = m_staInfo.size ();
-  nRusAssigned = m_staInfo.size ();
-  ruType = GetNumberAndTypeOfRus (bw, nRusAssigned);
-}
+  std::size_t nRusAssigned = m_candidates.size ();
+  HeRu::RuType ruType;
 
-//HeRu::RuType ruType = GetNumberAndTypeOfRus (bw, nRusAssigned);
+  if (m_candidates.size () > 1 && !GetDlSchedulingPolicy (m_schedulingPolicy).IsEqualSplit ())
+    {
+      Largest_Weighted_First ();
+      nRusAssigned = mappedRuAllocated.size ();
 
-///////////////////////////////////////////////////////
+      if (nRusAssigned == 0)
+        {
+          // no feasible RU allocation exists, fall back to the equal split
+          nRusAssigned = std::min (m_candidates.size (), static_cast<std::size_t> (m_nStations));
+          ruType = GetNumberAndTypeOfRus (bw, nRusAssigned);
+        }
+      else
+        {
+          ruType = mappedRuAllocated.begin ()->second;
+        }
+    }
+  else if (m_adaptiveNStations)
+    {
+      // serve the number of stations maximizing the estimated goodput
+      nRusAssigned = SelectNumberOfUsers (bw, m_candidates, ruType);
+    }
+  else
+    {
+      ruType = GetNumberAndTypeOfRus (bw, nRusAssigned);
+    }
 
-//std::cout<<nRusAssigned << " stations are being assigned a " << ruType << " RU\n";
- // NS_LOG_DEBUG (nRusAssigned << " stations are being assigned a " << ruType << " RU");
+  NS_LOG_DEBUG (nRusAssigned << " stations are being assigned an RU");
 
-std::cout<<"\n before Intilaizing DlOfdmaInfo dlOfdmaInfo\n";
   DlOfdmaInfo dlOfdmaInfo;
-  auto staInfoIt = m_staInfo.begin (); // iterator over the list of candidate receivers
-
-  if(staAllocated1.empty()){
-    for (std::size_t i = 0; i < nRusAssigned; i++){
-      
-      std::cout<<"\n staAllocated1 is empty"<<i;
-      NS_ASSERT (staInfoIt != m_staInfo.end ());
-      dlOfdmaInfo.staInfo.insert (*staInfoIt);
-      staInfoIt++;
-    }
-  }else if(staAllocated1.size()>0){
-        auto sti = staAllocated1.begin (); // iterator over the list of candidate receivers
-        for (std::size_t i = 0; i < finalRUAlloc.size(); i++){
-           std::cout<<"\n staAllocated1 is > 0"<<i;
-        	NS_ASSERT (sti != staAllocated1.end ());
-          dlOfdmaInfo.staInfo.insert (*sti);
-          sti++;
+
+  if (mappedRuAllocated.empty ())
+    {
+      // the first nRusAssigned candidates are served
+      for (std::size_t i = 0; i < nRusAssigned; i++)
+        {
+          uint16_t aid = m_candidates[i];
+          dlOfdmaInfo.staInfo.insert ({m_staTable.address[aid], {aid, m_staTable.tid[aid]}});
+        }
+    }
+  else
+    {
+      // the stations selected by Largest_Weighted_First are served
+      for (auto& sta : mappedRuAllocated)
+        {
+          dlOfdmaInfo.staInfo.insert ({m_staTable.address[sta.first], {sta.first, m_staTable.tid[sta.first]}});
         }
     }
-  
-    std::cout<<"\n After DlOfdmaInfo initialization\n";
 
-  ///////////////////////////////////////////////////////////////////////////////////////////////////////////
   // if not all the stations are assigned an RU, the first station to serve next
   // time is the first one that was not served this time
-  if (nRusAssigned < m_staInfo.size ())
+  if (nRusAssigned < m_candidates.size ())
     {
-      NS_ASSERT (staInfoIt != m_staInfo.end ());
-      m_startStation = staInfoIt->second.aid;
-      std::cout<<"Next station to serve has AID=" << m_startStation<<"\n";
+      m_startStation = m_candidates[nRusAssigned];
     }
 
-  auto firstSTA = m_staInfo.begin (); 
-  m_startStation=firstSTA->second.aid; ////// Thinkkkkkk
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+  if (m_txopUserRotation && Simulator::Now () < m_txopEnd)
+    {
+      // the next DL MU PPDUs of this TXOP serve other stations, if possible
+      for (auto& sta : dlOfdmaInfo.staInfo)
+        {
+          m_servedInTxop.insert (sta.second.aid);
+        }
+      m_nSentPpdus++;
+    }
 
   NS_LOG_DEBUG ("Next station to serve has AID=" << m_startStation);
 
-
-    std::cout<<"\n before InitTxVectorAndParams func call\n";
-
-
+  if (m_selectAckSequence)
+    {
+      // use the ack sequence with the lowest cost for the selected receivers among
+      // those fitting the remaining TXOP. If none fits, keep the one returned by the
+      // ack policy selector, which the receivers were selected with
+      Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (m_mpdu->GetHeader ().GetQosTid ())];
+      Time available = (txop->GetTxopLimit ().IsStrictlyPositive () ? txop->GetTxopRemaining () : Time::Max ());
+      Time minCost = Time::Max ();
+      for (auto ackSequence : {DlMuAckSequenceType::DL_SU_FORMAT, DlMuAckSequenceType::DL_MU_BAR,
+                               DlMuAckSequenceType::DL_AGGREGATE_TF})
+        {
+          Time cost = GetDlMuAckCost (dlOfdmaInfo.staInfo, ruType, ackSequence, available);
+          NS_LOG_DEBUG ("Cost of ack sequence " << +ackSequence << ": " << cost);
+          if (cost < minCost)
+            {
+              minCost = cost;
+              m_dlMuAckSequence = ackSequence;
+            }
+        }
+    }
 
   InitTxVectorAndParams (dlOfdmaInfo.staInfo, ruType, m_dlMuAckSequence);
   dlOfdmaInfo.params = m_txParams;
 
-    std::cout<<"\n after InitTxVectorAndParams func call\n";
-
-
- 
+  // set the RU of every user and its MCS, which is selected based on the quality
+  // of its link and on the RU size
+  auto setRuAndMcs = [this] (uint16_t aid, HeRu::RuSpec ru)
+    {
+      auto userInfo = m_txVector.GetHeMuUserInfoMap ().at (aid);
+      uint8_t mcs = GetMuMcs (aid, ru.ruType, userInfo.mcs.GetMcsValue ());
+      NS_LOG_DEBUG ("STA with AID=" << aid << " assigned " << ru << " and HE MCS " << +mcs);
+      m_txVector.SetHeMuUserInfo (aid, {ru, WifiPhy::GetHeMcs (mcs), userInfo.nss});
+    };
 
   if (ruType == HeRu::RU_2x996_TONE)
     {
-      HeRu::RuSpec ru = {true, ruType, 1};
-      NS_LOG_DEBUG ("STA " << m_staInfo.front ().first << " assigned " << ru);
-      m_txVector.SetRu (ru, m_staInfo.front ().second.aid);
+      setRuAndMcs (dlOfdmaInfo.staInfo.begin ()->second.aid, {true, ruType, 1});
     }
   else
     {
@@ -1243,111 +2702,92 @@ std::cout<<"\n before Intilaizing DlOfdmaInfo dlOfdmaInfo\n";
         }
 
       auto mapIt = dlOfdmaInfo.staInfo.begin ();
-        if(mappedRuAllocated.size()!=0){
-        std::size_t ru26 = 0;
-        std::size_t ru52 = 0;
-        std::size_t ru106 = 0;
-        std::size_t ru242 = 0;
-        std::size_t ru484 = 0;
-          std::vector<int>::size_type len = mappedRuAllocated.size();
-          std::cout<<"\n mappedRuAllocated size="<<len;
-          for (unsigned i=0; i<len; i++){
-           HeRu::RuSpec ru;
-        switch(mappedRuAllocated[i]){
-          case HeRu::RU_26_TONE: ru26++;
-                     ru = {true, mappedRuAllocated[i],ru26};
-                   break;
-          case HeRu::RU_52_TONE: ru52++;
-                     ru = {true, mappedRuAllocated[i],ru52};
-                   break;
-          case HeRu::RU_106_TONE: ru106++;
-                     ru = {true, mappedRuAllocated[i],ru106};
-                   break;
-          case HeRu::RU_242_TONE: ru242++;
-                    ru = {true, mappedRuAllocated[i],ru242};
-                   break;
-          case HeRu::RU_484_TONE: ru484++;
-                    ru = {true, mappedRuAllocated[i],ru484};
-                   break;
-        default: break;
-          }
-            std::cout<<"\n STA ----" << mapIt->first << " assigned---- " << ru;
-           NS_LOG_DEBUG ("STA " << mapIt->first << " assigned " << ru);
-           m_txVector.SetRu (ru, mapIt->second.aid);
-           mapIt++;
-          }
+      if (!mappedRuAllocated.empty ())
+        {
+          // place the RUs so that they do not overlap in the tone plan
+          std::map<uint16_t, HeRu::RuSpec> ruSpecs = PlaceRus (m_low->GetPhy ()->GetChannelWidth (),
+                                                               mappedRuAllocated);
+          for (; mapIt != dlOfdmaInfo.staInfo.end (); mapIt++)
+            {
+              setRuAndMcs (mapIt->second.aid, ruSpecs.at (mapIt->second.aid));
+            }
         }
-        else{
-
-              for (auto primary80MHz : primary80MHzSet)
+      else
+        {
+          for (auto primary80MHz : primary80MHzSet)
+            {
+              for (std::size_t ruIndex = 1; ruIndex <= HeRu::m_heRuSubcarrierGroups.at ({bw, ruType}).size (); ruIndex++)
                 {
-                  for (std::size_t ruIndex = 1; ruIndex <= HeRu::m_heRuSubcarrierGroups.at ({bw, ruType}).size (); ruIndex++)
-                    {
-                      NS_ASSERT (mapIt != dlOfdmaInfo.staInfo.end ());
-                      HeRu::RuSpec ru = {primary80MHz, ruType, ruIndex};
-                      NS_LOG_DEBUG ("STA " << mapIt->first << " assigned " << ru);
-                      m_txVector.SetRu (ru, mapIt->second.aid);
-                      mapIt++;
-                    }
+                  NS_ASSERT (mapIt != dlOfdmaInfo.staInfo.end ());
+                  setRuAndMcs (mapIt->second.aid, {primary80MHz, ruType, ruIndex});
+                  mapIt++;
                 }
-             }
-}
+            }
+        }
+    }
+
   dlOfdmaInfo.txVector = m_txVector;
 
   if (m_txParams.GetDlMuAckSequenceType () == DlMuAckSequenceType::DL_MU_BAR
       || m_txParams.GetDlMuAckSequenceType () == DlMuAckSequenceType::DL_AGGREGATE_TF)
     {
-      Ptr<WifiRemoteStationManager> stationManager = GetWifiRemoteStationManager ();
       // The Trigger Frame to be returned is built from the TX vector used for the DL MU PPDU
       // (i.e., responses will use the same set of RUs) and modified to ensure that responses
       // are sent at a rate not higher than MCS 5.
       dlOfdmaInfo.trigger = GetTriggerFrameHeader (dlOfdmaInfo.txVector, 5);
-      dlOfdmaInfo.trigger.SetUlLength (m_low->CalculateUlLengthForBlockAcks (dlOfdmaInfo.trigger, m_txParams));
+      dlOfdmaInfo.trigger.SetUlLength (GetUlLengthForBlockAcks (dlOfdmaInfo.trigger, dlOfdmaInfo.txVector,
+                                                                dlOfdmaInfo.staInfo));
       SetTargetRssi (dlOfdmaInfo.trigger);
     }
 
-finalRUAlloc.clear();
-mappedRuAllocated.clear();
-
-
-  std::cout<<"\nsetting mcs before\n";
-
-if(random_MCS.size()>1){
-  std::cout<<"\nsetting mcs inside loop\n";
-unsigned int x=0;
-auto userInfoMap = dlOfdmaInfo.txVector.GetHeMuUserInfoMap ();
-for (auto& userInfo : userInfoMap)
+  m_metrics->Increment (mappedRuAllocated.empty () ? RrOfdmaMetrics::EQUAL_SPLIT_ALLOCATIONS
+                                                   : RrOfdmaMetrics::CUSTOM_ALLOCATIONS);
+  m_metrics->Record (RrOfdmaMetrics::USERS_PER_PPDU, m_txVector.GetHeMuUserInfoMap ().size ());
+  for (auto& userInfo : m_txVector.GetHeMuUserInfoMap ())
     {
-      uint8_t mcs = random_MCS.at(x);
-      NS_LOG_FUNCTION("MCS"<<mcs);
- dlOfdmaInfo.txVector.SetHeMuUserInfo (userInfo.first, {userInfo.second.ru,
-                                                     WifiPhy::GetHeMcs (mcs),
-                                                     userInfo.second.nss});
-x++;
+      m_metrics->Record (RrOfdmaMetrics::RU_SIZE, GetNTones (userInfo.second.ru.ruType));
     }
-  random_MCS.clear();
- }
-  
-
-  std::cout<<"\nsetting mcs after\n";
-staAllocated1.clear();
-
-
+  NotifyDecision (OfdmaTxFormat::DL_OFDMA, true, !mappedRuAllocated.empty ());
 
+  mappedRuAllocated.clear ();
+  return dlOfdmaInfo;
+}
 
+void
+RrOfdmaManager::NotifyDecision (OfdmaTxFormat format, bool withUsers, bool weighted)
+{
+  // building the record is skipped if nobody is listening
+  if (m_decisionTrace.IsEmpty ())
+    {
+      return;
+    }
 
-// auto userInfoMap = dlMuTxVector.GetHeMuUserInfoMap ();
+  SchedulerDecision decision;
+  decision.format = format;
+  decision.policy = m_schedulingPolicy;
+  decision.txopRemaining = 0;
+  decision.nUsers = 0;
 
-//   for (auto& userInfo : userInfoMap)
-//     {
-//       uint8_t mcs = std::min (userInfo.second.mcs.GetMcsValue (), maxMcs);
-//       dlMuTxVector.SetHeMuUserInfo (userInfo.first, {userInfo.second.ru,
-//                                                      WifiPhy::GetHeMcs (mcs),
-//                                                      userInfo.second.nss});
-//     }
+  Ptr<QosTxop> txop = m_qosTxop[QosUtilsMapTidToAc (m_mpdu->GetHeader ().GetQosTid ())];
+  if (txop->GetTxopLimit ().IsStrictlyPositive ())
+    {
+      decision.txopRemaining = txop->GetTxopRemaining ().GetNanoSeconds ();
+    }
 
+  if (withUsers)
+    {
+      for (auto& userInfo : m_txVector.GetHeMuUserInfoMap ())
+        {
+          NS_ASSERT (decision.nUsers < MAX_DECISION_USERS);
+          DecisionUser& user = decision.users[decision.nUsers++];
+          user.aid = userInfo.first;
+          user.ru = userInfo.second.ru;
+          user.mcs = userInfo.second.mcs.GetMcsValue ();
+          user.weight = (weighted ? m_staTable.weight[userInfo.first] : 0);
+        }
+    }
 
-  return dlOfdmaInfo;
+  m_decisionTrace (decision);
 }
 
 CtrlTriggerHeader
@@ -1365,15 +2805,11 @@ RrOfdmaManager::GetTriggerFrameHeader (WifiTxVector dlMuTxVector, uint8_t maxMcs
 
   return CtrlTriggerHeader (TriggerFrameType::MU_BAR_TRIGGER, dlMuTxVector);
 }
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-
-
 
 OfdmaManager::UlOfdmaInfo
 RrOfdmaManager::ComputeUlOfdmaInfo (void)
 {
-  CtrlTriggerHeader trigger (TriggerFrameType::BASIC_TRIGGER, m_txVector);
+  CtrlTriggerHeader trigger (m_ulTriggerType, m_txVector);
   trigger.SetUlLength (m_txVector.GetLength ());
   SetTargetRssi (trigger);
 
@@ -25,13 +25,120 @@
 #define RR_OFDMA_MANAGER_H
 
 #include "ofdma-manager.h"
-#include "interference-helper.h"
+#include "ns3/traced-callback.h"
 #include "wifi-phy.h"
-#include "yans-wifi-phy.h"
+#include <array>
 #include <list>
+#include <ostream>
+#include <set>
 
 namespace ns3 {
 
+/**
+ * \ingroup wifi
+ *
+ * Aggregate metrics collected by RrOfdmaManager: counters of the decisions
+ * taken and histograms of the users per PPDU, of the RU sizes and of the
+ * wall-clock time spent by the scheduler. The metrics object is reachable
+ * through the Metrics attribute of RrOfdmaManager, so that it can be read at
+ * the end of a simulation or polled periodically.
+ */
+class RrOfdmaMetrics : public Object
+{
+public:
+  /**
+   * \brief Get the type ID.
+   * \return the object TypeId
+   */
+  static TypeId GetTypeId (void);
+
+  RrOfdmaMetrics ();
+  virtual ~RrOfdmaMetrics ();
+
+  /// Counters
+  enum Counter : uint8_t
+  {
+    DL_OFDMA_RETURNS = 0,          //!< SelectTxFormat returned DL_OFDMA
+    UL_OFDMA_RETURNS,              //!< SelectTxFormat returned UL_OFDMA
+    NON_OFDMA_RETURNS,             //!< SelectTxFormat returned NON_OFDMA
+    TXOP_SHORTAGE_FALLBACKS,       //!< the remaining TXOP was too short for an MU exchange
+    SHORT_MAX_DURATION_FALLBACKS,  //!< the time available for an HE TB PPDU was too short
+    CUSTOM_ALLOCATIONS,            //!< DL MU PPDUs with RUs sized by weight
+    EQUAL_SPLIT_ALLOCATIONS,       //!< DL MU PPDUs with RUs of equal size
+    AIRTIME_CACHE_HITS,            //!< airtime cache hits
+    AIRTIME_CACHE_MISSES,          //!< airtime cache misses
+    BSRP_TRIGGERS,                 //!< BSRP Trigger Frames sent
+    N_COUNTERS
+  };
+
+  /// Histograms
+  enum HistogramId : uint8_t
+  {
+    USERS_PER_PPDU = 0,            //!< number of users of DL and UL MU PPDUs
+    RU_SIZE,                       //!< number of tones of the RUs assigned to users
+    SELECT_TX_FORMAT_TIME,         //!< wall-clock time (ns) spent in SelectTxFormat
+    COMPUTE_DL_OFDMA_INFO_TIME,    //!< wall-clock time (ns) spent in ComputeDlOfdmaInfo
+    UL_PADDING_PERCENT,            //!< percentage of an HE TB PPDU padded by each user
+    DL_PPDUS_PER_TXOP,             //!< number of DL MU PPDUs prepared in a TXOP (with TxopUserRotation)
+    N_HISTOGRAMS
+  };
+
+  /**
+   * Histogram: lower bound of each bin -> number of samples. Bins of the
+   * time histograms have power-of-two widths, the other bins hold a single value.
+   */
+  typedef std::map<uint64_t, uint64_t> Histogram;
+
+  /**
+   * Increment the given counter.
+   *
+   * \param counter the counter
+   */
+  void Increment (Counter counter);
+  /**
+   * Add a sample to the given histogram.
+   *
+   * \param id the histogram
+   * \param value the sample
+   */
+  void Record (HistogramId id, uint64_t value);
+
+  /**
+   * \param counter the counter
+   * \return the value of the given counter
+   */
+  uint64_t GetCounter (Counter counter) const;
+  /**
+   * \param id the histogram
+   * \return the given histogram
+   */
+  const Histogram& GetHistogram (HistogramId id) const;
+
+  /**
+   * \param counter the counter
+   * \return the name of the given counter
+   */
+  static const char* GetCounterName (Counter counter);
+  /**
+   * \param id the histogram
+   * \return the name of the given histogram
+   */
+  static const char* GetHistogramName (HistogramId id);
+
+  /// Reset all the counters and histograms
+  void Reset (void);
+  /**
+   * Print all the counters and histograms.
+   *
+   * \param os the output stream
+   */
+  void Print (std::ostream& os) const;
+
+private:
+  std::array<uint64_t, N_COUNTERS> m_counters;       //!< counters
+  std::array<Histogram, N_HISTOGRAMS> m_histograms;  //!< histograms
+};
+
 /**
  * \ingroup wifi
  *
@@ -41,6 +148,11 @@ namespace ns3 {
  * which the AP has frames to transmit belonging to the AC who gained access to the
  * channel or higher. The maximum number of stations that can be granted an RU
  * is configurable. Associated stations are served in a round robin fashion.
+ * Alternatively, the SchedulingPolicy attribute selects a policy (LWDF,
+ * proportional fair or max rate) that ranks stations by a weight and assigns
+ * them RUs sized in proportion to their weight. The stations solicited by
+ * UL OFDMA transmissions are selected, in round robin order, among those that
+ * reported to have frames to send, independently of DL transmissions.
  */
 //class WifiPhy;
 
@@ -56,7 +168,75 @@ public:
   RrOfdmaManager ();
   virtual ~RrOfdmaManager ();
 
+  /**
+   * \return the aggregate metrics of the scheduler
+   */
+  Ptr<RrOfdmaMetrics> GetMetrics (void) const;
+
+  /**
+   * \return the number of durations found in the airtime cache (zero once
+   *         the object is disposed)
+   */
+  uint64_t GetAirtimeCacheHits (void) const;
+  /**
+   * \return the number of durations that had to be computed because they were
+   *         not found in the airtime cache
+   */
+  uint64_t GetAirtimeCacheMisses (void) const;
+
+  /// A user of a scheduling decision
+  struct DecisionUser
+  {
+    uint16_t aid;        //!< AID of the station
+    HeRu::RuSpec ru;     //!< RU assigned to the station
+    uint8_t mcs;         //!< HE MCS used to transmit to the station
+    double weight;       //!< scheduling weight (0 if the policy is not weight based)
+  };
+
+  /// Maximum number of users of a scheduling decision (26-tone RUs in 160 MHz)
+  static const std::size_t MAX_DECISION_USERS = 74;
+
+  /// Record of a scheduling decision, passed to the SchedulerDecision trace source
+  struct SchedulerDecision
+  {
+    OfdmaTxFormat format;        //!< selected transmission format
+    uint8_t policy;              //!< scheduling policy (see SchedulingPolicy)
+    int64_t txopRemaining;       //!< remaining TXOP duration in ns (0 if no TXOP limit)
+    uint8_t nUsers;              //!< number of valid entries in users
+    DecisionUser users[MAX_DECISION_USERS]; //!< users of the DL or UL MU transmission
+  };
+
+  /**
+   * TracedCallback signature for scheduling decisions.
+   *
+   * \param decision the scheduling decision
+   */
+  typedef void (* SchedulerDecisionTracedCallback)(const SchedulerDecision& decision);
+
+  /// Policies used to select the stations to serve and size their RUs
+  enum SchedulingPolicy
+  {
+    ROUND_ROBIN = 0,
+    LWDF,
+    PROPORTIONAL_FAIR,
+    MAX_RATE
+  };
+
+protected:
+  virtual void DoDispose (void);
+
 private:
+  /**
+   * Connect to the trace sources of the PHY, MacLow, the remote station manager
+   * and the MAC queues that provide the state of the stations.
+   */
+  void ConnectTraces (void);
+  /**
+   * Disconnect from the trace sources connected by ConnectTraces, so that they
+   * cannot call into this object once it is disposed.
+   */
+  void DisconnectTraces (void);
+
   /**
    * Select the format of the next transmission, assuming that the AP gained
    * access to the channel to transmit the given MPDU.
@@ -116,125 +296,677 @@ private:
    */
   CtrlTriggerHeader GetTriggerFrameHeader (WifiTxVector dlMuTxVector, uint8_t maxMcs);
 
-  uint8_t m_nStations;                                         //!< Number of stations/slots to fill
-  uint16_t m_startStation;                                     //!< AID of the station to start with
-  std::list<std::pair<Mac48Address, DlPerStaInfo>> m_staInfo;  //!< Info for the stations the AP has frames to send to
-  WifiTxVector m_txVector;                                     //!< TX vector
-  MacLowTransmissionParameters m_txParams;                     //!< TX params
-  DlMuAckSequenceType m_dlMuAckSequence;                       //!< DL MU ack sequence type
-  UlMuAckSequenceType m_ulMuAckSequence;                       //!< UL MU ack sequence type
-  bool m_forceDlOfdma;                                         //!< return DL_OFDMA even if no DL MU PPDU was built
-  bool m_enableUlOfdma;     
-
-                                 //!< enable the scheduler to also return UL_OFDMA
-  uint32_t m_ulPsduSize;
-                                       //!< the size in byte of the solicited PSDU
-  uint16_t m_bw;              
-std::vector<std::vector<int> > RU20{
-    {242},
-    {106,106,26},
-    {106,52,52,26},
-    {106,52,26,26,26},
-    {52,52,52,52,26},
-    {106,26,26,26,26,26},
-    {52,52,52,26,26,26},
-    {52,52,26,26,26,26,26},
-    {52,26,26,26,26,26,26,26},
-    {26,26,26,26,26,26,26,26,26}
+  /// An RU tiling, i.e., a set of non-overlapping RUs sorted by decreasing size
+  typedef std::vector<HeRu::RuType> RuTiling;
+
+  /**
+   * Get the maximum number of RUs that a channel of the given bandwidth can be
+   * partitioned into (i.e., the number of 26-tone RUs).
+   *
+   * \param bandwidth the channel bandwidth in MHz
+   * \return the maximum number of RUs (0 if the bandwidth is not supported)
+   */
+  static std::size_t GetMaxNRus (uint16_t bandwidth);
+
+  /**
+   * Get all the distinct tilings of a channel of the given bandwidth made of
+   * exactly the given number of RUs. A tiling covers the whole channel, except
+   * possibly for the center 26-tone RUs of 20 MHz and 80 MHz channels, which may
+   * be left unassigned (e.g., 106+106 on a 20 MHz channel). Tilings are computed
+   * the first time they are requested and cached afterwards.
+   *
+   * \param bandwidth the channel bandwidth in MHz (20, 40, 80 or 160)
+   * \param nRus the number of RUs
+   * \return the candidate tilings (empty if nRus exceeds the maximum number of
+   *         RUs for the given bandwidth)
+   */
+  const std::vector<RuTiling>& GetRuTilings (uint16_t bandwidth, std::size_t nRus);
+
+  /**
+   * Get all the distinct tilings of an RU of the given type with RUs of the same
+   * or smaller size, grouped by number of RUs.
+   *
+   * \param ruType the RU type
+   * \return a vector whose i-th element holds the tilings made of i RUs
+   */
+  static std::vector<std::set<RuTiling>> GetSubTilings (HeRu::RuType ruType);
+
+  /**
+   * Get the default tiling of a channel of the given bandwidth for the given
+   * number of stations, i.e., the candidate tiling whose smallest RUs are the
+   * largest (max-min fairness among equally demanding stations). If the number of
+   * stations exceeds the maximum number of RUs, the latter is used.
+   *
+   * \param bandwidth the channel bandwidth in MHz (20, 40, 80 or 160)
+   * \param nStations the number of stations
+   * \return the selected tiling (empty if nStations is null)
+   */
+  RuTiling RuAlloc (uint16_t bandwidth, std::size_t nStations);
+
+  /**
+   * Get the type of the RU spanning the whole channel of the given bandwidth.
+   *
+   * \param bandwidth the channel bandwidth in MHz (20, 40, 80 or 160)
+   * \return the RU type
+   */
+  static HeRu::RuType GetChannelRuType (uint16_t bandwidth);
+
+  /**
+   * Get the number of tones of the given RU type.
+   *
+   * \param ruType the RU type
+   * \return the number of tones
+   */
+  static uint16_t GetNTones (HeRu::RuType ruType);
+
+  /**
+   * Select, among the candidate tilings of a channel of the given bandwidth, the
+   * tiling whose RU shares (in terms of tones) best match the shares of the given
+   * demands, i.e., minimize the L1 distance between the two share vectors. RUs
+   * are mapped to stations in decreasing order of size and demand. If the total
+   * demand is null, the default tiling returned by RuAlloc is used.
+   *
+   * \param bandwidth the channel bandwidth in MHz (20, 40, 80 or 160)
+   * \param demands the demand (e.g., weight or backlog) of each station. It must
+   *                not include more stations than the maximum number of RUs
+   * \return the RU type assigned to each station, in the same order as demands
+   */
+  std::vector<HeRu::RuType> SelectRuTiling (uint16_t bandwidth, const std::vector<double>& demands);
+
+  /// Information about a station that is candidate for being assigned an RU
+  struct RuCandidate
+  {
+    uint16_t aid;       //!< AID of the station
+    double weight;      //!< scheduling weight of the station
+    uint32_t backlog;   //!< bytes the AP has to transmit to the station
+    uint8_t mcs;        //!< HE MCS used for SU transmissions to the station
+    uint8_t nss;        //!< number of spatial streams used to transmit to the station
+  };
+
+  /**
+   * Estimate the data rate of an HE transmission on an RU of the given type.
+   *
+   * \param ruType the RU type
+   * \param mcs the HE MCS
+   * \param nss the number of spatial streams
+   * \param guardInterval the guard interval in nanoseconds
+   * \return the data rate in bit/s
+   */
+  static uint64_t GetHeRuDataRate (HeRu::RuType ruType, uint8_t mcs, uint8_t nss, uint16_t guardInterval);
+
+  /**
+   * Solve the assignment problem for the given square matrix, i.e., find the
+   * one-to-one assignment of rows to columns maximizing the sum of the values of
+   * the selected elements, by means of the Hungarian algorithm (O(n^3)).
+   *
+   * \param value the square matrix of values
+   * \return the column assigned to each row
+   */
+  static std::vector<std::size_t> SolveAssignment (const std::vector<std::vector<double>>& value);
+
+  /**
+   * Assign the given RUs to the given candidate stations so as to maximize the
+   * weighted sum of the bytes the stations can receive in a DL MU PPDU of the
+   * given duration. The bytes a station can receive in an RU are estimated from
+   * the MCS it would be assigned on that RU (see GetMuMcs) and its number of
+   * spatial streams and are capped by its backlog.
+   *
+   * \param rus the RUs to assign (e.g., the RUs of a tiling)
+   * \param candidates the candidate stations (as many as the RUs)
+   * \param duration the duration of the DL MU PPDU
+   * \return the index (in rus) of the RU assigned to each candidate station
+   */
+  std::vector<std::size_t> AssignRus (const std::vector<HeRu::RuType>& rus,
+                                      const std::vector<RuCandidate>& candidates, Time duration) const;
+
+  /**
+   * Update the quality of the link with the station that transmitted the given
+   * frame. Connected to the MonitorSnifferRx trace source of the AP PHY.
+   *
+   * \param packet the received packet
+   * \param channelFreqMhz the frequency of the channel
+   * \param txVector the TX vector used to transmit the packet
+   * \param aMpdu information about the A-MPDU the packet is part of
+   * \param signalNoise the signal and noise power in dBm
+   */
+  void NotifyMonitorSnifferRx (Ptr<const Packet> packet, uint16_t channelFreqMhz,
+                               WifiTxVector txVector, MpduInfo aMpdu, SignalNoiseDbm signalNoise);
+
+  /**
+   * Get the HE MCS to use to transmit to the given station on an RU of the given
+   * type, i.e., the highest MCS whose minimum SNR does not exceed the SNR recently
+   * measured on the frames received from the station. If no recent measurement is
+   * available, the given MCS (selected for SU transmissions) is returned.
+   *
+   * \param aid the AID of the station
+   * \param ruType the type of the RU assigned to the station
+   * \param suMcs the MCS selected by the remote station manager for SU transmissions
+   * \return the HE MCS to use
+   */
+  uint8_t GetMuMcs (uint16_t aid, HeRu::RuType ruType, uint8_t suMcs) const;
+
+  /**
+   * Update the average rate of the stations addressed by the PSDUs included in the
+   * given PPDU, assuming that the PSDUs are delivered. If a transmission failure
+   * is then reported for a station, the update is reverted by NotifyTxFailed.
+   * Connected to the ForwardDown trace source of MacLow.
+   *
+   * \param psduMap the PSDUs included in the PPDU
+   * \param txVector the TX vector used to transmit the PPDU
+   */
+  void NotifyPsduForwardedDown (WifiPsduMap psduMap, WifiTxVector txVector);
+
+  /**
+   * Select the format of the next transmission. Called by SelectTxFormat,
+   * which collects metrics on the returned format and on the time spent.
+   *
+   * \param mpdu the MPDU the AP intends to transmit
+   * \return the format of the next transmission
+   */
+  OfdmaTxFormat DoSelectTxFormat (Ptr<const WifiMacQueueItem> mpdu);
+
+  /**
+   * Fire the SchedulerDecision trace source, if any callback is connected.
+   *
+   * \param format the selected transmission format
+   * \param withUsers whether the users of the current MU TX vector are part of the decision
+   * \param weighted whether the users were selected based on their weight
+   */
+  void NotifyDecision (OfdmaTxFormat format, bool withUsers, bool weighted = false);
+
+  /**
+   * Get the template of the DL MU TX vector, i.e., a TX vector including all
+   * the parameters that do not depend on the users. The template is rebuilt
+   * (and the cached response durations are discarded) only when the channel
+   * width, the guard interval or the frequency of the PHY change, in which
+   * case the airtime cache is also cleared.
+   *
+   * \return the template of the DL MU TX vector
+   */
+  const WifiTxVector& GetMuTxVectorTemplate (void);
+
+  /**
+   * Get a DL MU TX vector to estimate durations with. Every given station is
+   * assigned an RU of the given type (or, if requested, of the type stored in
+   * mappedRuAllocated for the station), the MCS returned by GetMuMcs for that
+   * RU and its number of spatial streams. RU indices do not affect durations
+   * and are not assigned.
+   *
+   * \param stations the AIDs of the stations
+   * \param ruType the type of the RUs assigned to the stations
+   * \param useMappedRus whether the RU types in mappedRuAllocated take precedence
+   * \return the DL MU TX vector
+   */
+  WifiTxVector GetEstimateTxVector (const std::vector<uint16_t>& stations, HeRu::RuType ruType,
+                                    bool useMappedRus);
+
+  /// Computations whose results are stored in the airtime cache
+  enum AirtimeKind : uint8_t
+  {
+    DL_RESPONSE = 0,    //!< duration of the response to a DL MU PPDU
+    DL_BA_LENGTH,       //!< UL length of the Block Acks solicited by a MU-BAR
+    UL_RESPONSE,        //!< duration of the frames exchanged around an HE TB PPDU
+    UL_BSRP_RESPONSE,   //!< duration of the frames exchanged around a BSRP response
+    MU_PSDU_DURATION    //!< duration of an MU PPDU carrying a PSDU of a given user
   };
 
-std::vector<std::vector<int> > RU40{
-    {484},
-
-    {242,242},
-
-    {242,106,106,26},
-
-    {242,106,52,52,26},
-    {106,106,106,106,52},
-
-    {242,106,52,26,26,26},
-    {242,52,52,52,52,26},
-    {106,106,106,106,26,26},
-    {106,106,106,52,52,52},
-
-    {242,106,26,26,26,26,26},
-    {242,52,52,52,26,26,26},
-    {106,106,106,52,52,26,26},
-    {106,106,52,52,52,52,52},
-    
-    {242,52,52,26,26,26,26,26},
-    {106,106,106,52,26,26,26,26},
-    {106,106,52,52,52,52,26,26},
-    {106,52,52,52,52,52,52,52},
-
-    
-    {242,52,26,26,26,26,26,26,26},
-
-    {242,26,26,26,26,26,26,26,26,26},
-
-    {106,106,106,26,26,26,26,26,26},
-    {106,106,52,52,52,26,26,26,26},
-    {106,106,52,52,26,26,26,26,26,26},
-    {106,106,52,26,26,26,26,26,26,26,26},
-    {106,106,26,26,26,26,26,26,26,26,26,26},
-
-    {106,52,52,52,52,52,52,26,26},
-    {106,52,52,52,52,52,26,26,26,26},
-    {106,52,52,52,52,26,26,26,26,26,26},
-    {106,52,52,52,26,26,26,26,26,26,26,26},
-    {106,52,52,26,26,26,26,26,26,26,26,26,26},
-    {106,52,26,26,26,26,26,26,26,26,26,26,26,26},
-    {106,26,26,26,26,26,26,26,26,26,26,26,26,26,26},
-    {52,52,52,52,52,52,52,52,26,26},
-    {52,52,52,52,52,52,52,26,26,26,26},
-    {52,52,52,52,52,52,26,26,26,26,26,26},
-    {52,52,52,52,52,26,26,26,26,26,26,26,26},
-    {52,52,52,52,26,26,26,26,26,26,26,26,26,26},
-    {52,52,52,26,26,26,26,26,26,26,26,26,26,26,26},
-    {52,52,26,26,26,26,26,26,26,26,26,26,26,26,26,26},
-    {52,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26},
-    {26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26}
+  /**
+   * Key of the airtime cache. The computations are pure functions of the PHY
+   * configuration, the ack sequence and the RU, MCS, NSS and BlockAck agreement
+   * of the users.
+   */
+  struct AirtimeKey
+  {
+    AirtimeKind kind;              //!< the computation
+    uint16_t channelWidth;         //!< channel width (MHz)
+    uint16_t guardInterval;        //!< guard interval (ns)
+    uint8_t ackSequence;           //!< DL or UL MU ack sequence type
+    std::vector<uint64_t> users;   //!< sorted packed parameters of the users (see PackAirtimeUser)
+    uint64_t target;               //!< packed parameters of the user the computation refers to, if any
+    uint32_t bytes;                //!< byte count bucket, if any
+
+    /**
+     * \param other the other key
+     * \return true if this key precedes the other key in lexicographic order
+     */
+    bool operator< (const AirtimeKey& other) const;
   };
 
+  /**
+   * \param ruType the RU type of a user
+   * \param mcs the HE MCS of the user
+   * \param nss the number of spatial streams of the user
+   * \param ack the BlockAckReq and BlockAck types of the user, if relevant (see PackAirtimeAck)
+   * \return the given values packed into a 64-bit integer
+   */
+  static uint64_t PackAirtimeUser (HeRu::RuType ruType, uint8_t mcs, uint8_t nss, uint32_t ack = 0);
+
+  /**
+   * \param barType the type of BlockAckReq
+   * \param baType the type of BlockAck
+   * \return the variants of the given types and the length of the BlockAck
+   *         bitmap packed into a 32-bit integer
+   */
+  static uint32_t PackAirtimeAck (const BlockAckReqType& barType, const BlockAckType& baType);
+
+  /**
+   * Get the type of the BlockAckReq and BlockAck frames exchanged with the given
+   * station for the given TID. Compressed types are returned if no BlockAck
+   * agreement is established.
+   *
+   * \param address the MAC address of the station
+   * \param tid the TID
+   * \param barType the type of BlockAckReq
+   * \param baType the type of BlockAck
+   */
+  void GetBlockAckTypes (Mac48Address address, uint8_t tid, BlockAckReqType& barType, BlockAckType& baType);
+
+  /**
+   * Get the key of the airtime cache for the given computation.
+   *
+   * \param kind the computation
+   * \param ackSequence the ack sequence type
+   * \param users the packed parameters of the users
+   * \param bytes the byte count bucket, if any
+   * \param target the packed parameters of the user the computation refers to, if any
+   * \return the key of the airtime cache
+   */
+  AirtimeKey GetAirtimeKey (AirtimeKind kind, uint8_t ackSequence, std::vector<uint64_t> users,
+                            uint32_t bytes = 0, uint64_t target = 0);
+
+  /**
+   * Get the key of the airtime cache for the given computation, which involves
+   * the users of the given TX vector.
+   *
+   * \param kind the computation
+   * \param ackSequence the ack sequence type
+   * \param txVector the TX vector
+   * \param bytes the byte count bucket, if any
+   * \param staId the STA-ID of the user the computation refers to, if any
+   * \return the key of the airtime cache
+   */
+  AirtimeKey GetAirtimeKey (AirtimeKind kind, uint8_t ackSequence, const WifiTxVector& txVector,
+                            uint32_t bytes = 0, uint16_t staId = 0);
+
+  /**
+   * Look up the given key in the airtime cache and update the hit/miss counters.
+   *
+   * \param key the key
+   * \param value the cached value, if found
+   * \return whether the key was found
+   */
+  bool FindAirtime (const AirtimeKey& key, int64_t& value);
+
+  /**
+   * Store the given value in the airtime cache. The cache is cleared when it
+   * reaches its maximum size, so that keys that are no longer used (e.g., those
+   * of stations that left the BSS) do not accumulate.
+   *
+   * \param key the key
+   * \param value the value
+   */
+  void StoreAirtime (const AirtimeKey& key, int64_t value);
+
+  /**
+   * Get the duration of an MU PPDU carrying a PSDU of the given size sent to or
+   * by the given user. Unless the exact duration is requested, the size is rounded
+   * up to a multiple of 256 bytes, hence the returned duration may slightly exceed
+   * the actual one. Durations that end up in a transmitted TX vector must be exact.
+   *
+   * \param size the PSDU size in bytes
+   * \param txVector the TX vector describing the users of the MU PPDU
+   * \param staId the STA-ID of the user
+   * \param exact whether the duration is computed for the exact size
+   * \return the duration of the MU PPDU
+   */
+  Time GetMuPsduDuration (uint32_t size, const WifiTxVector& txVector, uint16_t staId, bool exact = false);
+
+  /**
+   * Get the duration of the response to a DL MU PPDU sent to the given stations,
+   * which are assigned an RU of the given type (unless a different type is
+   * assigned by Largest_Weighted_First), with the given ack sequence.
+   * m_txVector and m_txParams are overwritten if the duration is not cached.
+   *
+   * \param staList the receiver stations of the DL MU PPDU
+   * \param ruType the RU type
+   * \param ackSequence the ack sequence type
+   * \return the duration of the response
+   */
+  Time GetDlMuResponseDuration (const std::map<Mac48Address, DlPerStaInfo>& staList,
+                                HeRu::RuType ruType, DlMuAckSequenceType ackSequence);
+
+  /**
+   * Get the cost of acknowledging a DL MU PPDU sent to the given stations with
+   * the given ack sequence, i.e., the time by which the Trigger Frames aggregated
+   * to the PSDUs (if any) extend the DL MU PPDU plus the duration of the response
+   * (which includes the MU-BAR or the BlockAckReq frames, if any).
+   * m_txVector and m_txParams are overwritten if the response is not cached.
+   *
+   * \param staList the receiver stations of the DL MU PPDU
+   * \param ruType the RU type (unless a different type is assigned by Largest_Weighted_First)
+   * \param ackSequence the ack sequence type
+   * \param available the time available for the DL MU PPDU and its response
+   *                  (Time::Max () if unlimited)
+   * \return the cost of the ack sequence, or Time::Max () if a DL MU PPDU carrying
+   *         the first frame queued for every station does not fit, together with
+   *         its response, into the available time
+   */
+  Time GetDlMuAckCost (const std::map<Mac48Address, DlPerStaInfo>& staList, HeRu::RuType ruType,
+                       DlMuAckSequenceType ackSequence, Time available);
+
+  /**
+   * Select the number k of the given stations to serve with RUs of equal size
+   * that maximizes the estimated goodput, i.e., the bytes delivered to the first
+   * k stations divided by the duration of the DL MU PPDU (including preamble
+   * and padding) and of its response.
+   *
+   * \param bandwidth the channel bandwidth in MHz
+   * \param stations the AIDs of the stations, in the order they are served
+   * \param ruType set to the type of the RUs assigned to the stations
+   * \return the number of stations to serve
+   */
+  std::size_t SelectNumberOfUsers (uint16_t bandwidth, const std::vector<uint16_t>& stations,
+                                   HeRu::RuType& ruType);
+
+  /**
+   * Get the UL length to set in the given MU-BAR to solicit the Block Acks,
+   * given the current TX params.
+   *
+   * \param trigger the MU-BAR
+   * \param txVector the TX vector the MU-BAR was built from
+   * \param staList the receivers of the DL MU PPDU
+   * \return the UL length
+   */
+  uint16_t GetUlLengthForBlockAcks (const CtrlTriggerHeader& trigger, const WifiTxVector& txVector,
+                                    const std::map<Mac48Address, DlPerStaInfo>& staList);
+
+  /**
+   * Invalidate the SU TX vector cached for the given station, since the remote
+   * station manager may change rate after a transmission failure, and remove the
+   * bytes of the failed PSDU from the average rate of the station. Connected to
+   * the MacTxDataFailed and MacTxFinalDataFailed trace sources of the remote
+   * station manager.
+   *
+   * \param address the MAC address of the station
+   */
+  void NotifyTxFailed (Mac48Address address);
+
+  /**
+   * Get the TX vector used for SU transmissions to the given station. The TX
+   * vector is requested to MacLow (and hence to the remote station manager) only
+   * if the cached one is invalid or older than m_suTxVectorTimeout. The cache is
+   * also refreshed with the TX vector of every SU PPDU sent to the station.
+   *
+   * \param aid the AID of the station
+   * \param mpdu an MPDU addressed to the station
+   * \return the TX vector used for SU transmissions to the station
+   */
+  WifiTxVector GetSuTxVector (uint16_t aid, Ptr<const WifiMacQueueItem> mpdu);
+
+  /**
+   * Update the exponentially weighted average of the rate at which the given
+   * station is served, given that the given amount of bytes has just been sent
+   * to it. The bytes are credited before the outcome of the transmission is known
+   * and are kept until the next update, unless RevertAverageRate is called in the
+   * meantime. The average is decayed with time constant m_avgRateTau. This takes O(1).
+   *
+   * \param aid the AID of the station
+   * \param bytes the amount of bytes sent to the station
+   */
+  void UpdateAverageRate (uint16_t aid, uint32_t bytes);
+  /**
+   * Remove the bytes credited by the last call to UpdateAverageRate from the
+   * average rate of the given station, because their transmission failed.
+   * Calling this method again before the next update has no effect.
+   *
+   * \param aid the AID of the station
+   */
+  void RevertAverageRate (uint16_t aid);
+
+  /**
+   * Get the current value of the average rate at which the given station is served.
+   *
+   * \param aid the AID of the station
+   * \return the average rate in bit/s
+   */
+  double GetAverageRate (uint16_t aid) const;
+
+  /**
+   * Get the rate at which the given station could currently be served if it were
+   * assigned the whole channel.
+   *
+   * \param aid the AID of the station
+   * \param suTxVector the TX vector used for SU transmissions to the station
+   * \return the instantaneous rate in bit/s
+   */
+  double GetInstantaneousRate (uint16_t aid, const WifiTxVector& suTxVector) const;
+
+  /**
+   * Make the station table consistent with the given list of associated stations,
+   * by extending the table to the largest AID and resetting the entries whose
+   * AID has been assigned to a new station.
+   *
+   * \param staList the list of associated stations ((AID, MAC address) pairs)
+   */
+  void UpdateStationTable (const std::map<uint16_t, Mac48Address>& staList);
+
+  /**
+   * Read the number of frames queued for the given station from the AC queues
+   * and the retransmit queues of the block ack managers. This is only needed
+   * when a station is added to the station table, as the backlog is updated
+   * incrementally afterwards. The queues do not provide the bytes queued for a
+   * station, hence only the bytes of the frames enqueued afterwards are counted.
+   *
+   * \param aid the AID of the station
+   */
+  void InitBacklog (uint16_t aid);
+
+  /**
+   * Set the number of frames queued for the given station and TID and update
+   * the backlog bitmap accordingly.
+   *
+   * \param aid the AID of the station
+   * \param tid the TID
+   * \param nPackets the number of queued frames
+   */
+  void SetQueuedPackets (uint16_t aid, uint8_t tid, uint32_t nPackets);
+
+  /**
+   * Update the backlog (frames and bytes) of the receiver of the given frame,
+   * which has been enqueued. Connected to the Enqueue trace source of the MAC queues.
+   *
+   * \param item the enqueued frame
+   */
+  void NotifyEnqueue (Ptr<const WifiMacQueueItem> item);
+
+  /**
+   * Update the backlog (frames and bytes) of the receiver of the given frame,
+   * which has been dequeued or removed. Connected to the Dequeue trace source of
+   * the MAC queues.
+   *
+   * \param item the dequeued frame
+   */
+  void NotifyDequeue (Ptr<const WifiMacQueueItem> item);
+
+  /**
+   * \param address the MAC address of a station
+   * \return the AID of the given station, or 0 if the station is not in the
+   *         station table
+   */
+  uint16_t GetAid (Mac48Address address) const;
+
+  /**
+   * Get the bitmask of the 26-tone RUs (bit i corresponds to the 26-tone RU with
+   * index i+1) occupied by the given RU in a channel of the given bandwidth. For
+   * 160 MHz channels, the bitmask refers to an 80 MHz segment.
+   *
+   * \param bandwidth the channel (or segment) bandwidth in MHz (20, 40 or 80)
+   * \param ruType the RU type
+   * \param index the RU index
+   * \return the bitmask of the occupied 26-tone RUs
+   */
+  static uint64_t GetRuMask (uint16_t bandwidth, HeRu::RuType ruType, std::size_t index);
+
+  /**
+   * Assign non-overlapping RU indices to the given RUs, by keeping track of the
+   * 26-tone RUs occupied in every 80 MHz segment (or in the whole channel, if
+   * narrower). The given RU types must form a valid tiling of the channel.
+   *
+   * \param bandwidth the channel bandwidth in MHz (20, 40, 80 or 160)
+   * \param ruTypes the RU type assigned to each station (by AID)
+   * \return the RU assigned to each station (by AID)
+   */
+  std::map<uint16_t, HeRu::RuSpec> PlaceRus (uint16_t bandwidth,
+                                             const std::map<uint16_t, HeRu::RuType>& ruTypes) const;
 
-InterferenceHelper m_interference;
- //WifiPhy powww; 
+  /**
+   * Detect whether a new TXOP started since the last channel access, in which
+   * case the set of stations served in the current TXOP is cleared.
+   *
+   * \param txopRemaining the remaining TXOP duration (zero if the AC does not hold a TXOP)
+   */
+  void UpdateTxopState (Time txopRemaining);
 
-//Reshan
+  /**
+   * \param aid the AID of a station
+   * \return true if TxopUserRotation is enabled and the given station has been
+   *         served by a DL MU PPDU of the current TXOP
+   */
+  bool IsServedInTxop (uint16_t aid) const;
 
-//const YansWifiPhy powww;  
-WifiSpectrumBand GetBand (uint16_t bandWidth, uint8_t bandIndex = 0);
+  /**
+   * Select the users of an HE TB PPDU among the associated stations that reported
+   * a non-null buffer status (or did not report it) and assign them RUs sized in
+   * proportion to the reported buffer status. Stations are visited in round robin
+   * order, starting from m_ulStartStation. m_txVector is set to the TX vector
+   * describing the selected users, their RUs and MCSs.
+   *
+   * \param staList the associated stations ((AID, MAC address) pairs)
+   * \param nextStation set to the AID of the station to start with next time,
+   *                    if at least a user is selected
+   * \return the number of selected users
+   */
+  std::size_t ScheduleUlUsers (const std::map<uint16_t, Mac48Address>& staList, uint16_t& nextStation);
 
-  std::list<std::pair<uint32_t, uint16_t>> dataStaPair;  
-  std::vector<std::pair<double, uint16_t>> dataStaPair1;
-   std::vector<std::pair<double, int>> finalStaPairIndex;
-  std::list<std::pair<double, uint16_t>> powerLevel;
-   std::list<std::pair<int, uint16_t>> QosType;
-   std::vector<uint32_t> v_dataStaPair;
-   std::vector<double> v_powerLevel;
-   std::vector<int> v_QosType;
-   double final_cost;
-   std::vector<int> random_MCS;
-std::vector<int> selective_MCS;
+  /**
+   * Select the users of a BSRP Trigger Frame, i.e., up to BsrpGroupSize stations
+   * whose buffer status has not been reported or solicited for longer than
+   * BufferStatusTimeout, starting from the least recently refreshed ones, and
+   * assign them RUs of equal size. If at least a user is selected, m_txVector is
+   * set to the TX vector describing the users, their RUs and MCSs.
+   *
+   * \param staList the associated stations ((AID, MAC address) pairs)
+   * \return the number of selected users
+   */
+  std::size_t ScheduleBsrpUsers (const std::map<uint16_t, Mac48Address>& staList);
 
-RxSignalInfo rxSnr;
-                                                                //!< for TESTING only
-std::vector<int> finalRUAlloc;
-std::vector<std::pair<Mac48Address, DlPerStaInfo>> staAllocated;
-std::list<std::pair<Mac48Address, DlPerStaInfo>> staAllocated1;
+  /**
+   * Set m_txVector to describe the given users of an HE TB PPDU, which are
+   * assigned non-overlapping RUs of the given types and the MCS selected based
+   * on the quality of their link.
+   *
+   * \param users the AIDs of the users
+   * \param ruTypes the type of the RU assigned to each user, in the same order
+   */
+  void SetUlUsers (const std::vector<uint16_t>& users, const std::vector<HeRu::RuType>& ruTypes);
 
-//std::list<std::pair<Mac48Address, DlPerStaInfo>> m_staInfo;
+  uint8_t m_nStations;                                         //!< Number of stations/slots to fill
+  uint16_t m_startStation;                                     //!< AID of the station to start with
+  uint16_t m_ulStartStation;                                   //!< AID of the station to start with for UL OFDMA
+  TriggerFrameType m_ulTriggerType;                            //!< type of the Trigger Frame soliciting the HE TB PPDU
+  bool m_enableBsrp;                                           //!< solicit stale buffer status with BSRP Trigger Frames
+  Time m_bufferStatusTimeout;                                  //!< time after which a buffer status is stale
+  uint8_t m_bsrpGroupSize;                                     //!< max number of stations solicited by a BSRP TF
+  bool m_lastUlBsrp;                                           //!< whether the last Trigger Frame sent was a BSRP TF
+  bool m_adaptiveNStations;                                    //!< select the number of stations by goodput
+  bool m_selectAckSequence;                                    //!< select the cheapest ack sequence per DL MU PPDU
+  bool m_txopUserRotation;                                     //!< serve different stations in a TXOP
+  Time m_txopEnd;                                              //!< end of the current TXOP
+  std::size_t m_nSentPpdus;                                    //!< number of DL MU PPDUs prepared in the TXOP
+  std::set<uint16_t> m_servedInTxop;                           //!< AIDs of the stations served in the TXOP
+  std::vector<uint16_t> m_candidates;                          //!< AIDs of the stations the AP has frames to send to
+  WifiTxVector m_txVector;                                     //!< TX vector
+  MacLowTransmissionParameters m_txParams;                     //!< TX params
+  DlMuAckSequenceType m_dlMuAckSequence;                       //!< DL MU ack sequence type
+  UlMuAckSequenceType m_ulMuAckSequence;                       //!< UL MU ack sequence type
+  bool m_forceDlOfdma;                                         //!< return DL_OFDMA even if no DL MU PPDU was built
+  bool m_enableUlOfdma;                                        //!< enable the scheduler to also return UL_OFDMA
+  uint32_t m_ulPsduSize;                                       //!< the size in byte of the solicited PSDU
+  std::map<std::pair<uint16_t, std::size_t>, std::vector<RuTiling>> m_ruTilings; //!< cached RU tilings
+  Time m_maxDlDuration;                                        //!< max duration of the DL MU PPDU being prepared
 
-std::vector<HeRu::RuType> mappedRuAllocated;
-void RuAlloc(int number_of_clients);
-void mapped_He_RU(std::vector<int> mapped);
-double calculate_a_i(int type_of_Application);
-double averageChannelcapacity();
-void Largest_Weighted_First();
-const YansWifiPhy powww;
+  /**
+   * Scheduler state of the associated stations, stored as a structure of arrays
+   * indexed by AID. The table persists across transmission opportunities and an
+   * entry is reset when its AID is assigned to a new station.
+   */
+  struct StationTable
+  {
+    /**
+     * Extend the table to hold the given number of entries.
+     *
+     * \param size the number of entries
+     */
+    void Resize (std::size_t size);
+    /**
+     * Reset the entry of the given AID, which is assigned to the given station.
+     *
+     * \param aid the AID
+     * \param address the MAC address of the station
+     */
+    void Reset (uint16_t aid, Mac48Address address);
+
+    std::vector<Mac48Address> address;  //!< MAC address of the station
+    std::vector<uint8_t> tid;           //!< TID of the frames to send to the station
+    std::vector<uint8_t> qosType;       //!< type of application (1: VO, 2: VI, 3: BE, 4: BK)
+    std::vector<uint32_t> backlog;      //!< bytes queued for the station with the selected TID
+    std::vector<uint32_t> holSize;      //!< size of the first frame queued for the station with the selected TID
+    std::vector<double> holDelay;       //!< head-of-line delay (seconds)
+    std::vector<double> weight;         //!< last computed scheduling weight
+    std::vector<uint8_t> mcs;           //!< HE MCS used for SU transmissions to the station
+    std::vector<uint8_t> nss;           //!< number of spatial streams used to transmit to the station
+    std::vector<double> instRate;       //!< rate (bit/s) achievable over the whole channel
+    std::vector<double> avgRate;        //!< average rate (bit/s) at the last-served time
+    std::vector<Time> lastServed;       //!< time a frame was last sent to the station
+    std::vector<uint32_t> lastCredit;   //!< bytes credited to the average rate at the last-served time
+    std::vector<double> snr;            //!< SNR (dB) measured on the last frame received from the station
+    std::vector<uint16_t> rxWidth;      //!< width (MHz) of the PPDU carrying that frame (0 if none)
+    std::vector<Time> lastRx;           //!< time the last frame was received from the station
+    std::vector<uint8_t> backlogTids;   //!< bitmap of the TIDs with frames queued for the station
+    std::vector<std::array<uint32_t, 8>> queuedPackets; //!< number of frames queued for each TID
+    std::vector<std::array<uint32_t, 8>> queuedBytes;   //!< bytes queued for each TID
+    std::vector<WifiTxVector> suTxVector; //!< cached TX vector for SU transmissions to the station
+    std::vector<Time> suTxVectorTime;   //!< time the TX vector was cached (Time::Min () if invalid)
+    std::vector<uint32_t> ulBuffer;     //!< bytes the station reported to have in its buffer
+    std::vector<Time> lastBsr;          //!< time the buffer status was last reported or solicited
+  };
 
+  StationTable m_staTable;                                     //!< per-station scheduler state
+  std::map<Mac48Address, uint16_t> m_staAid;                   //!< AID of the stations in the table
+  std::set<uint16_t> m_backlogged;                             //!< AIDs of the stations with queued frames
+  Time m_linkQualityTimeout;                                   //!< time after which a link quality entry is stale
+  bool m_tracesConnected;                                      //!< whether the PHY and MAC traces are connected
+  Time m_avgRateTau;                                           //!< time constant of the average rate
+  Time m_suTxVectorTimeout;                                    //!< time after which a cached SU TX vector is stale
+  WifiTxVector m_muTxVectorTemplate;                           //!< template of the DL MU TX vector
+  uint16_t m_phyFrequency;                                     //!< PHY frequency the template refers to
+  std::map<AirtimeKey, int64_t> m_airtimeCache;                //!< cached durations (time steps) and lengths
+  Ptr<RrOfdmaMetrics> m_metrics;                               //!< aggregate metrics
+  TracedCallback<const SchedulerDecision&> m_decisionTrace;    //!< scheduling decision trace source
+  SchedulingPolicy m_schedulingPolicy;                         //!< policy used to select and size users
+  std::map<uint16_t, HeRu::RuType> mappedRuAllocated;          //!< RU type assigned to each station (by AID)
 
+  /**
+   * \param type_of_Application the type of application (1: VO, 2: VI, 3: BE, 4: BK)
+   * \return the weight of the access category of the given type of application
+   */
+  double calculate_a_i (int type_of_Application);
+  /**
+   * Select the candidate stations with the highest weight and assign them RUs
+   * sized in proportion to their weight. The RU type of the selected stations
+   * is stored in mappedRuAllocated.
+   */
+  void Largest_Weighted_First (void);
 };
 
 